@@ -57,23 +57,27 @@ codec.decode(params.c_str(), params.size(), &binary_params[0]);
 template<int _CHARS_PER_LINE>
 struct base64_linebreak {
 
+    // separate types, so each switch handles all the values of its own
+    typedef enum {
+        step_A, step_B, step_C
+    } EncodeStep;
     typedef enum {
-        step_A, step_B, step_C,
         step_a, step_b, step_c, step_d
-    } Step;
+    } DecodeStep;
     
     enum {
         CHARS_PER_LINE = _CHARS_PER_LINE
     };
 
-    Step encodestep, decodestep;
+    EncodeStep encodestep;
+    DecodeStep decodestep;
     char encoderesult, decoderesult;
     int stepcount;
 
     inline base64_linebreak() : encodestep(step_A), decodestep(step_a), encoderesult(0), decoderesult(0), stepcount(0) {}
 
     inline void reset_encoder() {encodestep=step_A; encoderesult=0; stepcount=0;}
-    inline void reset_decoder() {encodestep=step_a; decoderesult=0;}
+    inline void reset_decoder() {decodestep=step_a; decoderesult=0;}
     
     inline unsigned int get_max_encoded_size(int input_decoded_size) {
         int ret = input_decoded_size * 4 / 3; // 6 bits into 8 bits
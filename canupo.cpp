@@ -33,6 +33,8 @@
 
 #include "points.hpp"
 #include "svd.hpp"
+#include "workchunks.hpp"
+#include "pyramid.hpp"
 
 #include <string.h>
 #include <stdlib.h>
@@ -47,7 +49,7 @@ using namespace boost;
 int help(const char* errmsg = 0) {
     if (errmsg) cout << "Error: " << errmsg << endl;
 cout << "\
-canupo scales... : data.xyz data_core.xyz data_core.msc [flag]\n\
+canupo scales... : data.xyz data_core.xyz data_core.msc [flag [tolerance] [max_neighbors]]\n\
   inputs: scales         # list of scales at which to perform the analysis\n\
                          # A scale correspond to a diameter for neighbor research.\n\
                          # The syntax minscale:increment:maxscale is accepted.\n\
@@ -63,6 +65,20 @@ canupo scales... : data.xyz data_core.xyz data_core.msc [flag]\n\
                          # boundaries in order to avoid spurious multi-scale relations\n\
   output: data_core.msc  # corresponding multiscale parameters at each core point\n\
   input: flag            # (optional) if the flag is set to 1 then an additionnal field is added into the output msc file for each core point: the angle (0<=a<=90°) between the vertical and the normal of the best 2D plane fit at that core point, at the largest given scale. 0 thus means a perfectly horizontal plane, 90 means a perfectly vertical one\n\
+                         # If the flag has the bit 2 set (ex: 2, or 3 with the above) then the neighborhood\n\
+                         # covariances are computed from a multi-resolution voxel pyramid of point moments.\n\
+                         # This is much faster at large scales on dense clouds.\n\
+                         # If the flag has the bit 4 set then the PCA at each scale is limited to a\n\
+                         # deterministic, spatially stratified subsample of max_neighbors points.\n\
+                         # This bounds the time spent on core points in very dense areas. The\n\
+                         # numbers of neighbors in the msc file are still the true ones.\n\
+                         # The pyramid does not visit the neighbors one by one, so this cap has no\n\
+                         # effect when the bit 2 is also set (ex: flag 6).\n\
+  input: tolerance       # (optional, with flag bit 2) relative size of the boundary voxels that may be\n\
+                         # approximated as a whole, ex: 0.05. Default is 0, for exact results.\n\
+  input: max_neighbors   # (with flag bit 4) max number of points for the PCA at each scale, ex: 2000.\n\
+                         # The extra values are given in this order when both are present: with\n\
+                         # flag 6, give both the tolerance and max_neighbors, ex: 6 0 2000.\n\
 "<<endl;
     return 0;
 }
@@ -147,11 +163,32 @@ int main(int argc, char** argv) {
     if (argc>separator+4) flag = atoi(argv[separator+4]);
 
     bool add_vertical_info = bool( (flag & 1) != 0 );
+    bool use_pyramid = bool( (flag & 2) != 0 );
+    bool cap_neighbors = bool( (flag & 4) != 0 );
+    // extra values for the flag bits, in increasing bit order
+    int extra_info_idx = separator+5;
+    FloatType pyramid_tolerance = 0;
+    if (use_pyramid && argc>extra_info_idx) pyramid_tolerance = atof(argv[extra_info_idx++]);
+    if (pyramid_tolerance<0) return help("Invalid pyramid tolerance");
+    int max_neighbors = 0;
+    if (cap_neighbors) {
+        if (argc<=extra_info_idx) return help("Missing value for the max number of neighbors");
+        max_neighbors = atoi(argv[extra_info_idx++]);
+        if (max_neighbors<3) return help("Invalid max number of neighbors, shall be at least 3");
+        if (use_pyramid) cout << "Warning: the max number of neighbors has no effect with the moment pyramid, ignored." << endl;
+    }
     
     cout << "Loading data files" << endl;
     
     PointCloud<Point> cloud;
     cloud.load_txt(datafilename);
+
+    MomentPyramid<Point> pyramid;
+    if (use_pyramid) {
+        cout << "Building the moment pyramid" << endl;
+        // finest voxels hold a few points on a surface
+        pyramid.build(cloud.data, cloud.cellside * 0.5);
+    }
     
     FILE* corepointsfile = fopen(corepointsfilename.c_str(), "r");
     bool use4 = false;
@@ -205,170 +242,218 @@ int main(int argc, char** argv) {
     cout << "Processing \"" << datafilename << "\" using core points from \"" << corepointsfilename << "\"" << endl;
     cout << "Percent complete: 0" << flush;
     
-    // for each core point
-    int nextpercentcomplete = 5;
-#pragma omp parallel for schedule(static)
-    for (int ptidx = 0; ptidx < corepoints.size(); ++ptidx) {
+    // Balance the work: the cost of a core point depends a lot on the local density,
+    // so process spatially coherent chunks of about equal cost, largest first
+    vector<int> ptorder;
+    vector<WorkChunk> chunks;
+    int nthreads = 1;
 #ifdef _OPENMP
-if (omp_get_thread_num()==0) {
-        int percentcomplete = ((ptidx+1) * 100 * omp_get_num_threads()) / corepoints.size();
-#else
-        int percentcomplete = ((ptidx+1) * 100) / corepoints.size();
-#endif
-        if (percentcomplete>=nextpercentcomplete) {
-            if (percentcomplete>=nextpercentcomplete) {
-                nextpercentcomplete+=5;
-                if (percentcomplete % 10 == 0) cout << percentcomplete << flush;
-                else if (percentcomplete % 5 == 0) cout << "." << flush;
-            }
-        }
-#ifdef _OPENMP
-}
+    nthreads = omp_get_max_threads();
 #endif
+    make_work_chunks(cloud, corepoints, *scales.begin() * 0.5, nthreads * 16, ptorder, chunks);
 
-        vector<DistPoint<Point> > neighbors;
-        vector<Point> neighsums; // avoid recomputing cumulated sums at each scale
-        
-        vector<FloatType> abdata(nscales*2);
-//        vector<FloatType> avgndist(nscales);
-        vector<int> nneigh(nscales);
-        int abdataidx = 0;
+    // for each core point
+    int nextpercentcomplete = 5;
+    int ncorecompleted = 0;
+#pragma omp parallel
+{
+    // per-thread scratch space, reused from one core point to the next
+    // so the capacity grown on dense areas is kept instead of reallocated
+    vector<NeighborIndex> neighbors;
+    vector<NeighborIndex> capped;
+    vector<int> capped_scratch;
+    vector<Point> neighsums; // avoid recomputing cumulated sums at each scale
+    vector<FloatType> A;
+    vector<FloatType> abdata(nscales*2);
+//    vector<FloatType> avgndist(nscales);
+    vector<int> nneigh(nscales);
+    vector<FloatType> eigenvectors(9);
+#pragma omp for schedule(dynamic,1)
+    for (int chunkidx = 0; chunkidx < (int)chunks.size(); ++chunkidx) {
+        for (int orderidx = chunks[chunkidx].begin; orderidx < chunks[chunkidx].end; ++orderidx) {
+            int ptidx = ptorder[orderidx];
+
+            neighbors.clear();
+            int abdataidx = 0;
         
-        // ab values implicitly reused from higher scale if there are not enough neighbors
-        // TODO: nearest neighbors of ab at higher scales and get average of the neighbors ab at low scale
-        FloatType a = 1.0/3.0, b = 1.0/3.0;
+            // ab values implicitly reused from higher scale if there are not enough neighbors
+            // TODO: nearest neighbors of ab at higher scales and get average of the neighbors ab at low scale
+            FloatType a = 1.0/3.0, b = 1.0/3.0;
         
-        // used only when computing the additionnal vertical info
-        FloatType vertical_angle = -1;
-        vector<FloatType> eigenvectors(9);
+            // used only when computing the additionnal vertical info
+            FloatType vertical_angle = -1;
         
-        // Scales shall be sorted from max to lowest 
-        for (ScaleSet::iterator scaleit = scales.begin(); scaleit != scales.end(); ++scaleit) {
-            // Neighborhood search only on max radius
-            if (scaleit == scales.begin()) {
-                // we have all neighbors, unsorted, but with distances computed already
-                // use scales = diameters, not radius
-                cloud.findNeighbors(back_inserter(neighbors), corepoints[ptidx], (*scaleit) * 0.5);
+            // Scales shall be sorted from max to lowest 
+            for (ScaleSet::iterator scaleit = scales.begin(); scaleit != scales.end(); ++scaleit) {
+                FloatType svalues[3];
+                bool have_svalues = false;
+                int nneighbors = 0;
+                // moments of the neighborhood directly from the voxel pyramid, no neighbor list
+                if (use_pyramid) {
+                    MomentSum moments = pyramid.query(corepoints[ptidx], (*scaleit) * 0.5, pyramid_tolerance);
+                    nneighbors = (int)moments.count;
+                    if (nneighbors>=3) {
+                        double S[9], W[3];
+                        moments.scatter(S);
+                        bool want_vertical = add_vertical_info && vertical_angle==-1;
+                        symeig(3, S, W, want_vertical);
+                        // eigenvalues in increasing order, the first eigenvector is the normal
+                        if (want_vertical) {
+                            vertical_angle = fabs(S[2]);
+                            if (vertical_angle>1) vertical_angle = 1;
+                            vertical_angle = acos(vertical_angle) * 180 / M_PI;
+                        }
+                        // these are already the eigenvalues, no need to square them
+                        for (int i=0; i<3; ++i) svalues[i] = max(0., W[2-i]);
+                        have_svalues = true;
+                    }
+                }
+                // Neighborhood search only on max radius
+                else if (scaleit == scales.begin()) {
+                    // we have all neighbors, unsorted, but with distances computed already
+                    // use scales = diameters, not radius
+                    cloud.findNeighborIndices(neighbors, corepoints[ptidx], (*scaleit) * 0.5);
 
-                // Sort the neighbors from closest to farthest, so we can process all lower scales easily
-                sort(neighbors.begin(), neighbors.end());
+                    // Sort the neighbors from closest to farthest, so we can process all lower scales easily
+                    sort(neighbors.begin(), neighbors.end());
                 
-                // pre-compute cumulated sums. The total is needed anyway at the larger scale
-                // so we might as well share the intermediates to lower levels
-                neighsums.resize(neighbors.size());
-                if (!neighbors.empty()) neighsums[0] = *neighbors[0].pt;
-                for (int i=1; i<neighbors.size(); ++i) neighsums[i] = neighsums[i-1] + *neighbors[i].pt;
-            }
-            // lower scale : restrict previously found neighbors to the new distance
-            else {
-                FloatType radiussq = *scaleit * *scaleit * 0.25;
-                // dicho search might be faster than sequencially from the vector end if there are many points
-                int dichofirst = 0;
-                int dicholast = neighbors.size();
-                int dichomed;
-                while (true) {
-                    dichomed = (dichofirst + dicholast) / 2;
-                    if (dichomed==dichofirst) break;
-                    if (radiussq==neighbors[dichomed].distsq) break;
-                    if (radiussq<neighbors[dichomed].distsq) { dicholast = dichomed; continue;}
-                    dichofirst = dichomed;
+                    // pre-compute cumulated sums. The total is needed anyway at the larger scale
+                    // so we might as well share the intermediates to lower levels
+                    neighsums.resize(neighbors.size());
+                    if (!neighbors.empty()) neighsums[0] = cloud.data[neighbors[0].idx];
+                    for (int i=1; i<neighbors.size(); ++i) neighsums[i] = neighsums[i-1] + cloud.data[neighbors[i].idx];
+                }
+                // lower scale : restrict previously found neighbors to the new distance
+                else {
+                    FloatType radiussq = *scaleit * *scaleit * 0.25;
+                    // dicho search might be faster than sequencially from the vector end if there are many points
+                    int dichofirst = 0;
+                    int dicholast = neighbors.size();
+                    int dichomed;
+                    while (true) {
+                        dichomed = (dichofirst + dicholast) / 2;
+                        if (dichomed==dichofirst) break;
+                        if (radiussq==neighbors[dichomed].distsq) break;
+                        if (radiussq<neighbors[dichomed].distsq) { dicholast = dichomed; continue;}
+                        dichofirst = dichomed;
+                    }
+                    // dichomed is now the last index with distance below or equal to requested radius
+                    neighbors.resize(dichomed+1);
+                    neighsums.resize(dichomed+1);
                 }
-                // dichomed is now the last index with distance below or equal to requested radius
-                neighbors.resize(dichomed+1);
-                neighsums.resize(dichomed+1);
-            }
             
-            // In any case we now have a vector of neighbors at the current scale
-            if (neighbors.size()>=3) {
-                FloatType svalues[3];
-                // use the pre-computed sums to get the average point
-                Point avg = neighsums.back() / neighsums.size();
-                // compute PCA on the neighbors at this scale
-                // a copy is needed as LAPACK destroys the matrix, and the center changes anyway
-                // => cannot keep the points from one scale to the lower, need to rebuild the matrix
-                vector<FloatType> A(neighbors.size() * 3);
-                for (int i=0; i<neighbors.size(); ++i) {
+                if (!use_pyramid) nneighbors = neighbors.size();
+                // In any case we now have a vector of neighbors at the current scale
+                if (!use_pyramid && neighbors.size()>=3) {
+                    const NeighborIndex* pcaneighbors = &neighbors[0];
+                    int npca = neighbors.size();
+                    // use the pre-computed sums to get the average point
+                    Point avg = neighsums.back() / neighsums.size();
+                    // bounded cost: PCA on a stratified subsample in very dense areas
+                    if (max_neighbors>0 && npca>max_neighbors) {
+                        cloud.stratifiedSubsample(pcaneighbors, npca, corepoints[ptidx], (*scaleit) * 0.5, max_neighbors, capped, capped_scratch);
+                        pcaneighbors = &capped[0];
+                        npca = max_neighbors;
+                        avg = Point();
+                        for (int i=0; i<npca; ++i) avg += cloud.data[capped[i].idx];
+                        avg /= npca;
+                    }
+                    // compute PCA on the neighbors at this scale
+                    // a copy is needed as LAPACK destroys the matrix, and the center changes anyway
+                    // => cannot keep the points from one scale to the lower, need to rebuild the matrix
+                    A.resize(npca * 3);
                     // A is column-major
-                    A[i] = neighbors[i].pt->x - avg.x;
-                    A[i+neighbors.size()] = neighbors[i].pt->y - avg.y;
-                    A[i+neighbors.size()+neighbors.size()] = neighbors[i].pt->z - avg.z;
-                }
-                // SVD decomposition handled by LAPACK
-                // compute the vertical info only at the larger scale
-                if (add_vertical_info && vertical_angle==-1) {
-                    svd(neighbors.size(), 3, &A[0], &svalues[0], false, &eigenvectors[0]);
-                    // column-major matrix, eigenvectors as rows
-                    Point e1(eigenvectors[0], eigenvectors[3], eigenvectors[6]);
-                    Point e2(eigenvectors[1], eigenvectors[4], eigenvectors[7]);
-                    // e3 shall be orthogonal to e1 and e2
-                    // use the cross-product since the two first components are
-                    // better conditionned
-                    // then project to (0,0,1), possibly reverting the orientation
-                    vertical_angle = fabs(e1.cross(e2).z);
-                    // ensure no idiotic out-of-range due to float-point precision...
-                    if (vertical_angle<0) vertical_angle = 0;
-                    if (vertical_angle>1) vertical_angle = 1;
-                    vertical_angle = acos(vertical_angle) * 180 / M_PI;
-                }
-                else svd(neighbors.size(), 3, &A[0], &svalues[0]);
-                // convert to percent variance explained by each dim
-                FloatType totalvar = 0;
-                for (int i=0; i<3; ++i) {
+                    cloud.gatherCentered(pcaneighbors, npca, avg, &A[0]);
+                    // SVD decomposition handled by LAPACK
+                    // compute the vertical info only at the larger scale
+                    if (add_vertical_info && vertical_angle==-1) {
+                        svd(npca, 3, &A[0], &svalues[0], false, &eigenvectors[0]);
+                        // column-major matrix, eigenvectors as rows
+                        Point e1(eigenvectors[0], eigenvectors[3], eigenvectors[6]);
+                        Point e2(eigenvectors[1], eigenvectors[4], eigenvectors[7]);
+                        // e3 shall be orthogonal to e1 and e2
+                        // use the cross-product since the two first components are
+                        // better conditionned
+                        // then project to (0,0,1), possibly reverting the orientation
+                        vertical_angle = fabs(e1.cross(e2).z);
+                        // ensure no idiotic out-of-range due to float-point precision...
+                        if (vertical_angle<0) vertical_angle = 0;
+                        if (vertical_angle>1) vertical_angle = 1;
+                        vertical_angle = acos(vertical_angle) * 180 / M_PI;
+                    }
+                    else svd(npca, 3, &A[0], &svalues[0]);
                     // singular values are squared roots of eigenvalues
-                    svalues[i] = svalues[i] * svalues[i]; // / (neighbors.size() - 1);
-                    totalvar += svalues[i];
+                    for (int i=0; i<3; ++i) svalues[i] = svalues[i] * svalues[i]; // / (neighbors.size() - 1);
+                    have_svalues = true;
+                }
+                if (have_svalues) {
+                    // convert to percent variance explained by each dim
+                    FloatType totalvar = 0;
+                    for (int i=0; i<3; ++i) totalvar += svalues[i];
+                    for (int i=0; i<3; ++i) svalues[i] /= totalvar;
+                    // Use barycentric coordinates : a for 1D, b for 2D and c for 3D
+                    // Formula on wikipedia page for barycentric coordinates
+                    // using directly the triangle in %variance space, they simplify a lot
+                    //FloatType c = 1 - a - b; // they sum to 1
+                    a = svalues[0] - svalues[1];
+                    b = 2 * svalues[0] + 4 * svalues[1] - 2;
                 }
-                for (int i=0; i<3; ++i) svalues[i] /= totalvar;
-                // Use barycentric coordinates : a for 1D, b for 2D and c for 3D
-                // Formula on wikipedia page for barycentric coordinates
-                // using directly the triangle in %variance space, they simplify a lot
-                //FloatType c = 1 - a - b; // they sum to 1
-                a = svalues[0] - svalues[1];
-                b = 2 * svalues[0] + 4 * svalues[1] - 2;
-            }
 
-            // negative values shall not happen, but there may be rounding errors and -1e25 is still <0
-            if (a<0) a=0; if (b<0) b=0; //if (c<0) c=0;
-            // similarly constrain the values to 0..1
-            if (a>1) a=1; if (b>1) b=1; //if (c>1) c=1;
+                // negative values shall not happen, but there may be rounding errors and -1e25 is still <0
+                if (a<0) a=0; if (b<0) b=0; //if (c<0) c=0;
+                // similarly constrain the values to 0..1
+                if (a>1) a=1; if (b>1) b=1; //if (c>1) c=1;
             
-            abdata[abdataidx++] = a;
-            abdata[abdataidx++] = b;
+                abdata[abdataidx++] = a;
+                abdata[abdataidx++] = b;
                         
-            nneigh[abdataidx/2-1] = neighbors.size();
+                nneigh[abdataidx/2-1] = nneighbors;
             
-            // compute average distance between nearest neighbors
+                // compute average distance between nearest neighbors
 #if 0
-            FloatType avgnd = 0;
-            for (int i=0; i<neighbors.size(); ++i) {
-                // use min sq dist threshold to eliminate the same point
-                int nidx = cloud.findNearest(*neighbors[i].pt, 1e-12);
-                avgnd += dist(*neighbors[i].pt, cloud.data[nidx]);
-                /*FloatType dmin2 = numeric_limits<FloatType>::max();
-                for (int j=0; j<neighbors.size(); ++j) {
-                    if (j==i) continue;
-                    FloatType d2 = dist2(*neighbors[i].pt, *neighbors[j].pt);
-                    if (d2<dmin2) dmin2 = d2;
+                FloatType avgnd = 0;
+                for (int i=0; i<neighbors.size(); ++i) {
+                    // use min sq dist threshold to eliminate the same point
+                    int nidx = cloud.findNearest(cloud.data[neighbors[i].idx], 1e-12);
+                    avgnd += dist(cloud.data[neighbors[i].idx], cloud.data[nidx]);
+                    /*FloatType dmin2 = numeric_limits<FloatType>::max();
+                    for (int j=0; j<neighbors.size(); ++j) {
+                        if (j==i) continue;
+                        FloatType d2 = dist2(cloud.data[neighbors[i].idx], cloud.data[neighbors[j].idx]);
+                        if (d2<dmin2) dmin2 = d2;
+                    }
+                    avgnd += sqrt(dmin2);*/
                 }
-                avgnd += sqrt(dmin2);*/
-            }
-            avgnd /= neighbors.size();
-            avgndist[abdataidx/2] = avgnd;            
+                avgnd /= neighbors.size();
+                avgndist[abdataidx/2] = avgnd;            
 #endif
-        }
-        // need to write full blocks sequencially for each point
+            }
+            // need to write full blocks sequencially for each point
 #pragma omp critical
-        {
-            mscfile.write((char*)&corepoints[ptidx].x,sizeof(FloatType));
-            mscfile.write((char*)&corepoints[ptidx].y,sizeof(FloatType));
-            mscfile.write((char*)&corepoints[ptidx].z,sizeof(FloatType));
-            if (!additionalInfo.empty()) mscfile.write((char*)&additionalInfo[ptidx],sizeof(FloatType));
-            if (add_vertical_info) mscfile.write((char*)&vertical_angle,sizeof(FloatType));
-            for (int i=0; i<abdata.size(); ++i) mscfile.write((char*)&abdata[i], sizeof(FloatType));
-            for (int i=0; i<nscales; ++i) mscfile.write((char*)&nneigh[i], sizeof(int));
-//            for (int i=0; i<nscales; ++i) mscfile.write((char*)&avgndist[i], sizeof(FloatType));
+            {
+                mscfile.write((char*)&corepoints[ptidx].x,sizeof(FloatType));
+                mscfile.write((char*)&corepoints[ptidx].y,sizeof(FloatType));
+                mscfile.write((char*)&corepoints[ptidx].z,sizeof(FloatType));
+                if (!additionalInfo.empty()) mscfile.write((char*)&additionalInfo[ptidx],sizeof(FloatType));
+                if (add_vertical_info) mscfile.write((char*)&vertical_angle,sizeof(FloatType));
+                for (int i=0; i<abdata.size(); ++i) mscfile.write((char*)&abdata[i], sizeof(FloatType));
+                for (int i=0; i<nscales; ++i) mscfile.write((char*)&nneigh[i], sizeof(int));
+    //            for (int i=0; i<nscales; ++i) mscfile.write((char*)&avgndist[i], sizeof(FloatType));
+            }
+        }
+        // progress on the number of core points actually completed, whichever thread did them
+        int ncompleted;
+#pragma omp atomic capture
+        ncompleted = ncorecompleted += chunks[chunkidx].end - chunks[chunkidx].begin;
+        int percentcomplete = (int)(((long long)ncompleted * 100) / corepoints.size());
+#pragma omp critical (progress)
+        while (percentcomplete>=nextpercentcomplete) {
+            if (nextpercentcomplete % 10 == 0) cout << nextpercentcomplete << flush;
+            else cout << "." << flush;
+            nextpercentcomplete+=5;
         }
     }
+}
     cout << endl;
     
     mscfile.close();
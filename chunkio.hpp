@@ -0,0 +1,169 @@
+//**********************************************************************
+//* This file is a part of the CANUPO project, a set of programs for   *
+//* classifying automatically 3D point clouds according to the local   *
+//* multi-scale dimensionality at each point.                          *
+//*                                                                    *
+//* Author & Copyright: Nicolas Brodu <nicolas.brodu@numerimoire.net>  *
+//*                                                                    *
+//* This project is free software; you can redistribute it and/or      *
+//* modify it under the terms of the GNU Lesser General Public         *
+//* License as published by the Free Software Foundation; either       *
+//* version 2.1 of the License, or (at your option) any later version. *
+//*                                                                    *
+//* This library is distributed in the hope that it will be useful,    *
+//* but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+//* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU  *
+//* Lesser General Public License for more details.                    *
+//*                                                                    *
+//* You should have received a copy of the GNU Lesser General Public   *
+//* License along with this library; if not, write to the Free         *
+//* Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,    *
+//* MA  02110-1301  USA                                                *
+//*                                                                    *
+//**********************************************************************/
+#ifndef CANUPO_CHUNKIO_HPP
+#define CANUPO_CHUNKIO_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef NO_MMAP
+#include <sys/mman.h>
+#endif
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "points.hpp"
+
+/*
+Streaming access to the xyz text files, for when the whole cloud need not be in memory.
+
+The lines are read by chunks and kept as text, so the parsing of a chunk can be done in
+parallel afterwards with parse_point_line. The same lines as in PointCloud::load_txt
+are considered, so a streamed file yields exactly the same points.
+*/
+
+struct TextChunkReader {
+    FILE* fp;
+    char* line;
+    size_t linelen;
+    size_t linenum;
+    // the comment lines are returned as well when true, for programs that copy them over
+    bool keep_comments;
+
+    TextChunkReader(const char* filename, bool _keep_comments = false) : line(0), linelen(0), linenum(0), keep_comments(_keep_comments) {
+        fp = fopen(filename, "r");
+    }
+    ~TextChunkReader() {
+        if (fp) fclose(fp);
+        free(line);
+    }
+
+    bool ok() const {return fp!=0;}
+
+    // reads up to maxlines point lines. The text of line i is at &text[offsets[i]],
+    // 0-terminated. Returns the number of lines, 0 at the end of the file
+    // The line numbers in the file, starting at 1, are stored if requested
+    int read(int maxlines, std::vector<char>& text, std::vector<size_t>& offsets, std::vector<size_t>* line_numbers = 0) {
+        text.clear();
+        offsets.clear();
+        if (line_numbers) line_numbers->clear();
+        if (!fp) return 0;
+        int num_read = 0;
+        while ((int)offsets.size()<maxlines && (num_read = getline(&line, &linelen, fp)) != -1) {
+            ++linenum;
+            if (linelen==0 || (line[0]=='#' && !keep_comments)) continue;
+            offsets.push_back(text.size());
+            if (line_numbers) line_numbers->push_back(linenum);
+            text.insert(text.end(), line, line + num_read + 1);
+        }
+        return offsets.size();
+    }
+};
+
+// same parsing as PointCloud::load_txt, ignoring the additional values
+template<class PointType>
+inline void parse_point_line(char* line, PointType& point) {
+    point = PointType();
+    int i = 0;
+    for (char* x = line; *x!=0 && i<PointType::dim; ++i) point[i] = fast_atof_next_token(x);
+}
+
+// the whole file in memory, mapped when possible, for the programs that copy
+// some of its lines over
+struct MappedTextFile {
+    int fd;
+    char* data;
+    size_t size;
+#ifdef NO_MMAP
+    std::vector<char> buffer;
+#endif
+    MappedTextFile(const char* name) : data(0), size(0) {
+        fd = open(name, O_RDONLY);
+        if (fd==-1) {std::cerr << "Could not load file: " << name << std::endl; exit(1);}
+        struct stat file_stats;
+        fstat(fd, &file_stats);
+        size = file_stats.st_size;
+        if (size==0) return;
+#ifndef NO_MMAP
+        data = (char*)mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data==(char*)(-1)) {
+            close(fd);
+            perror("Error with mmap");
+            exit(1);
+        }
+#else
+        buffer.resize(size);
+        for (size_t nread = 0; nread < size;) {
+            ssize_t n = read(fd, &buffer[nread], size - nread);
+            if (n<=0) {std::cerr << "Could not load file: " << name << std::endl; exit(1);}
+            nread += n;
+        }
+        data = &buffer[0];
+#endif
+    }
+    ~MappedTextFile() {
+#ifndef NO_MMAP
+        if (data) munmap(data, size);
+#endif
+        close(fd);
+    }
+    // offset just after the end of the line starting at the given offset
+    size_t line_end(size_t offset) const {
+        const char* eol = (const char*)memchr(data + offset, '\n', size - offset);
+        return eol ? eol - data + 1 : size;
+    }
+    // cuts the file in chunks of about chunksize bytes, beginning at line starts
+    // chunk c spans [begin[c], begin[c+1])
+    void split(size_t chunksize, std::vector<size_t>& begin) const {
+        int nchunks = std::max<size_t>(1, size / chunksize);
+        begin.resize(nchunks+1);
+        for (int c=0; c<=nchunks; ++c) {
+            size_t b = size * (double)c / nchunks;
+            if (c>0 && c<nchunks && data[b-1]!='\n') b = line_end(b);
+            begin[c] = std::max(b, c>0 ? begin[c-1] : 0);
+        }
+    }
+};
+
+// copies the lines starting at the given sorted offsets, by runs of consecutive lines
+inline void write_lines(std::ostream& out, const MappedTextFile& input, const std::vector<size_t>& offsets) {
+    size_t idx = 0;
+    while (idx < offsets.size()) {
+        size_t runbegin = offsets[idx];
+        size_t runend = runbegin;
+        // extend the run while the next line starts where this one ends
+        while (idx < offsets.size() && offsets[idx]==runend) {
+            runend = input.line_end(runend);
+            ++idx;
+        }
+        out.write(input.data + runbegin, runend - runbegin);
+    }
+}
+
+#endif
@@ -42,7 +42,12 @@ struct Classifier {
     
     Point2D refpt_pos, refpt_neg;
     
+    // decision function raster over [-absmaxXY,absmaxXY]^2, gridsize x gridsize cells
+    // of 3 values each: where the whole cell is on the same side of the same path segment
+    // the signed distance is affine, stored as wx * a + wy * b + c. Otherwise wx is NaN
+    // and the point is evaluated exactly.
     std::vector<FloatType> grid;
+    FloatType gridcellinv;
 
     void prepare() {
         using namespace std;
@@ -82,9 +87,58 @@ struct Classifier {
             ld.wx /= norm; ld.wy /= norm; ld.c /= norm;
             pathlines.push_back(ld);
         }
+
+        prepare_grid();
+    }
+
+    void prepare_grid() {
+        using namespace std;
+        grid.assign(gridsize * gridsize * 3, numeric_limits<FloatType>::quiet_NaN());
+        gridcellinv = 0;
+        if (!(absmaxXY>0)) return;
+        FloatType cellside = 2 * absmaxXY / gridsize;
+        gridcellinv = 1 / cellside;
+        // exact value and nearest segment at the cell corners
+        vector<FloatType> values((gridsize+1) * (gridsize+1));
+        vector<int> features((gridsize+1) * (gridsize+1));
+        for (int j=0; j<=gridsize; ++j) for (int i=0; i<=gridsize; ++i) {
+            values[j*(gridsize+1)+i] = classify2D_exact(-absmaxXY + i * cellside, -absmaxXY + j * cellside, &features[j*(gridsize+1)+i]);
+        }
+        for (int j=0; j<gridsize; ++j) for (int i=0; i<gridsize; ++i) {
+            int corners[4] = {j*(gridsize+1)+i, j*(gridsize+1)+i+1, (j+1)*(gridsize+1)+i, (j+1)*(gridsize+1)+i+1};
+            int feature = features[corners[0]];
+            // nearest to a segment end: the distance is not affine
+            if (feature<0) continue;
+            FloatType sign = values[corners[0]] < 0 ? -1 : 1;
+            bool affine = true;
+            for (int c=1; c<4; ++c) affine &= features[corners[c]]==feature && (values[corners[c]]<0 ? -1 : 1)==sign;
+            // the center as a safeguard against non-convex nearest segment regions
+            int centerfeature;
+            FloatType centervalue = classify2D_exact(-absmaxXY + (i+0.5) * cellside, -absmaxXY + (j+0.5) * cellside, &centerfeature);
+            affine &= centerfeature==feature && (centervalue<0 ? -1 : 1)==sign;
+            if (!affine) continue;
+            // the line shall not cross the cell either, so the sign of its equation is constant
+            const LineDef& ld = pathlines[feature];
+            FloatType lsign = 0;
+            for (int c=0; c<4; ++c) {
+                FloatType x = -absmaxXY + (i + (c&1)) * cellside;
+                FloatType y = -absmaxXY + (j + (c>>1)) * cellside;
+                FloatType v = ld.wx * x + ld.wy * y + ld.c;
+                if (c==0) lsign = v < 0 ? -1 : 1;
+                else if ((v < 0 ? -1 : 1) != lsign) affine = false;
+            }
+            if (!affine) continue;
+            // |line equation| is the distance, with the classification sign
+            FloatType f = sign * lsign;
+            grid[(j*gridsize+i)*3] = f * ld.wx;
+            grid[(j*gridsize+i)*3+1] = f * ld.wy;
+            grid[(j*gridsize+i)*3+2] = f * ld.c;
+        }
     }
 
-    FloatType classify2D_checkcondnum(FloatType a, FloatType b, Point2D& refpt, FloatType& condnumber) {
+    // feature, if given, is set to the index of the nearest path segment,
+    // or to -1 if the nearest point is a segment end
+    FloatType classify2D_checkcondnum(FloatType a, FloatType b, Point2D& refpt, FloatType& condnumber, int* feature = 0) {
         using namespace std;
         Point2D pt(a,b);
         // consider each path line as a mini-classifier
@@ -177,6 +231,7 @@ struct Classifier {
             if (closestToSeg < closestDist) {
                 selectedSeg = i;
                 closestDist = closestToSeg;
+                if (feature) *feature = projwithin ? i : -1;
             }
         }
         Point2D n(pathlines[selectedSeg].wx, pathlines[selectedSeg].wy);
@@ -187,15 +242,33 @@ struct Classifier {
     }
 
 
-    // classification in the 2D space
-    FloatType classify2D(FloatType a, FloatType b) {
+    // classification in the 2D space, without the raster
+    FloatType classify2D_exact(FloatType a, FloatType b, int* feature = 0) {
         FloatType condpos, condneg;
-        FloatType predpos = classify2D_checkcondnum(a,b,refpt_pos,condpos);
-        FloatType predneg = classify2D_checkcondnum(a,b,refpt_neg,condneg);
+        int featpos = -1, featneg = -1;
+        FloatType predpos = classify2D_checkcondnum(a,b,refpt_pos,condpos,&featpos);
+        FloatType predneg = classify2D_checkcondnum(a,b,refpt_neg,condneg,&featneg);
         // normal nearly aligned = bad conditionning, the lower the dot prod the better
-        if (condpos<condneg) return predpos;
+        if (condpos<condneg) {
+            if (feature) *feature = featpos;
+            return predpos;
+        }
+        if (feature) *feature = featneg;
         return -predneg;
     }
+
+    // classification in the 2D space, exact if prepare() was not called
+    FloatType classify2D(FloatType a, FloatType b) {
+        if (grid.empty()) return classify2D_exact(a,b);
+        FloatType gx = (a + absmaxXY) * gridcellinv;
+        FloatType gy = (b + absmaxXY) * gridcellinv;
+        if (gx>=0 && gx<gridsize && gy>=0 && gy<gridsize) {
+            const FloatType* cell = &grid[((int)gy*gridsize+(int)gx)*3];
+            // NaN fails the comparison
+            if (cell[0]==cell[0]) return cell[0] * a + cell[1] * b + cell[2];
+        }
+        return classify2D_exact(a,b);
+    }
     
     void project(FloatType* mscdata, FloatType& a, FloatType& b) {
         a = weights_axis1[weights_axis1.size()-1];
@@ -212,6 +285,58 @@ struct Classifier {
         project(mscdata,a,b);
         return classify2D(a,b);
     }
+
+    // batch version of classify2D, for (a,b) pairs as produced by ProjectionBank
+    void classify2D(const FloatType* ab, int npts, int abstride, FloatType* pred, int predstride) {
+        for (int i=0; i<npts; ++i) pred[i*predstride] = classify2D(ab[i*abstride], ab[i*abstride+1]);
+    }
+};
+
+// The projection axis of all classifiers stacked in a single matrix, so the
+// a,b values for every classifier are computed in one pass over the msc data.
+// The weights are transposed so the inner loop runs over the projections and
+// vectorizes, with the same summation order as Classifier::project.
+struct ProjectionBank {
+    int fdim, nproj;
+    // fdim rows of nproj weights: a1 b1 a2 b2 ...
+    std::vector<FloatType> weights;
+    std::vector<FloatType> bias;
+
+    ProjectionBank() : fdim(0), nproj(0) {}
+
+    void prepare(const Classifier* classifiers, int nclassifiers) {
+        fdim = nclassifiers>0 ? classifiers[0].weights_axis1.size()-1 : 0;
+        nproj = nclassifiers * 2;
+        weights.resize(fdim * nproj);
+        bias.resize(nproj);
+        for (int ci=0; ci<nclassifiers; ++ci) {
+            if ((int)classifiers[ci].weights_axis1.size()!=fdim+1 || (int)classifiers[ci].weights_axis2.size()!=fdim+1) {
+                std::cerr << "Inconsistent number of scales between the classifiers" << std::endl;
+                exit(1);
+            }
+            for (int d=0; d<fdim; ++d) {
+                weights[d*nproj + ci*2] = classifiers[ci].weights_axis1[d];
+                weights[d*nproj + ci*2+1] = classifiers[ci].weights_axis2[d];
+            }
+            bias[ci*2] = classifiers[ci].weights_axis1[fdim];
+            bias[ci*2+1] = classifiers[ci].weights_axis2[fdim];
+        }
+    }
+
+    // data: msc feature rows of the given stride, indices: the rows to project or null for
+    // the first npts rows. ab: npts rows of nproj values
+    void project(const FloatType* data, int stride, const int* indices, int npts, FloatType* ab) const {
+        for (int i=0; i<npts; ++i) {
+            const FloatType* x = data + (long)(indices ? indices[i] : i) * stride;
+            FloatType* out = ab + i * nproj;
+            for (int k=0; k<nproj; ++k) out[k] = bias[k];
+            const FloatType* w = &weights[0];
+            for (int d=0; d<fdim; ++d, w+=nproj) {
+                const FloatType xd = x[d];
+                for (int k=0; k<nproj; ++k) out[k] += w[k] * xd;
+            }
+        }
+    }
 };
 
 #endif
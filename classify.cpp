@@ -24,14 +24,18 @@
 #include <iostream>
 #include <limits>
 #include <fstream>
-#include <map>
+#include <algorithm>
+#include <string.h>
 
 #ifdef CHECK_CLASSIFIER
 #include <cairo/cairo.h>
 #endif
 
 #include "classifier.hpp"
+#include "formatting.hpp"
+#include "chunkio.hpp"
 #include "linearSVM.hpp"
+#include "helpers.hpp"
 
 using namespace std;
 using namespace boost;
@@ -54,6 +58,10 @@ classify features.prm scene.xyz scene_core.msc scene_annotated.xyz [pok [usage_f
                               # of each point, the confidence in the classification,\n\
                               # the number of neighbors at the min and max scales\n\
                               # Scene points are labelled with the class of the nearest core point.\n\
+                              # If the file name ends with .bin, a binary file is written instead:\n\
+                              # the number of points and of extra values (0 or 1) as two ints, then\n\
+                              # for each point x,y,z (floats), class (int), confidence (float), the\n\
+                              # number of neighbors at min and max scales (ints), extra value (float)\n\
   input: pok                  # Some threshold, expressed as a probability to make\n\
                               # a correct classification (0.5<pok<1). Use 0\n\
                               # to disable the threshold, which is also the default\n\
@@ -78,13 +86,6 @@ cout << "\n\
         return 0;
 }
 
-bool fpeq(FloatType a, FloatType b) {
-    static const FloatType epsilon = 1e-6;
-    if (b==0) return fabs(a)<epsilon;
-    FloatType ratio = a/b;
-    return ratio>1-epsilon && ratio<1+epsilon;
-}
-
 
 struct ClassifInfo {
     bool reliable;
@@ -146,39 +147,49 @@ int main(int argc, char** argv) {
         classifiers[ci].prepare();
     }
     classifparamsfile.close();
+    // all classifier projections at once, per block of core points
+    ProjectionBank projbank;
+    projbank.prepare(&classifiers[0], nclassifiers);
+    static const int projblock = 256;
+    // dense class indices for the votes, in increasing class number order
+    vector<int> classlabels;
+    for (int ci=0; ci<nclassifiers; ++ci) {
+        classlabels.push_back(classifiers[ci].class1);
+        classlabels.push_back(classifiers[ci].class2);
+    }
+    sort(classlabels.begin(), classlabels.end());
+    classlabels.erase(unique(classlabels.begin(), classlabels.end()), classlabels.end());
+    int nclasses = classlabels.size();
+    vector<int> minclassidx(nclassifiers), maxclassidx(nclassifiers);
+    for (int ci=0; ci<nclassifiers; ++ci) {
+        minclassidx[ci] = lower_bound(classlabels.begin(), classlabels.end(), min(classifiers[ci].class1, classifiers[ci].class2)) - classlabels.begin();
+        maxclassidx[ci] = lower_bound(classlabels.begin(), classlabels.end(), max(classifiers[ci].class1, classifiers[ci].class2)) - classlabels.begin();
+    }
 
     // reversed situation here compared to canupo:
     // - we load the core points in the cloud so as to perform neighbor searches
     // - the data itself is unstructured, not even loaded whole in memory
-    ifstream mscfile(argv[3], ifstream::binary);
+    MSCFile mscfile(argv[3]);
     // read the file header
-    int ncorepoints;
-    mscfile.read((char*)&ncorepoints,sizeof(ncorepoints));
-    int nscales_msc;
-    mscfile.read((char*)&nscales_msc, sizeof(int));
+    vector<FloatType> scales_msc;
+    int ptnparams;
+    int ncorepoints = read_msc_header(mscfile, scales_msc, ptnparams);
+    int nscales_msc = scales_msc.size();
     if (nscales_msc!=nscales) {
         cerr << "Inconsistent combination of multiscale file and classifier parameters (wrong number of scales)" << endl;
         cerr << "Scales in the classifier file:";
         for (int si=0; si<nscales; ++si) cerr << " " << scales[si];
         cerr << endl << "Scales in the multiscale file:";
-        for (int si=0; si<nscales_msc; ++si) {
-            FloatType scale_msc;
-            mscfile.read((char*)&scale_msc, sizeof(FloatType));
-            cerr << " " << scale_msc;
-        }
+        for (int si=0; si<nscales_msc; ++si) cerr << " " << scales_msc[si];
         cerr << endl;
         return 1;
     }
     for (int si=0; si<nscales; ++si) {
-        FloatType scale_msc;
-        mscfile.read((char*)&scale_msc, sizeof(FloatType));
-        if (!fpeq(scale_msc, scales[si])) {
+        if (!fpeq(scales_msc[si], scales[si])) {
             cerr << "Inconsistent combination of multiscale file and classifier parameters (not the same scales)" << endl;
             return 1;
         }
     }
-    int ptnparams;
-    mscfile.read((char*)&ptnparams, sizeof(int));
     if (ptnparams<3) {
         cerr << "Internal error: Multiscale file does not contain point coordinates" << endl;
         return 1;
@@ -193,47 +204,39 @@ int main(int argc, char** argv) {
     // extract only min/max scales neighbor stats for output file
     vector<int> nneigh_max_scale(ncorepoints);
     vector<int> nneigh_min_scale(ncorepoints);
-    //vector<FloatType> avg_ndist_max_scale(ncorepoints);
     coreCloud.data.resize(ncorepoints);
     coreCloud.xmin = numeric_limits<FloatType>::max();
     coreCloud.xmax = -numeric_limits<FloatType>::max();
     coreCloud.ymin = numeric_limits<FloatType>::max();
     coreCloud.ymax = -numeric_limits<FloatType>::max();
-    for (int pt=0; pt<ncorepoints; ++pt) {
-        mscfile.read((char*)&coreCloud.data[pt].x, sizeof(FloatType));
-        mscfile.read((char*)&coreCloud.data[pt].y, sizeof(FloatType));
-        mscfile.read((char*)&coreCloud.data[pt].z, sizeof(FloatType));
-        if (ptnparams>=4) mscfile.read((char*)&coreAdditionalInfo[pt], sizeof(FloatType));
+    int nrecords;
+    for (int blockbegin = 0; blockbegin < ncorepoints; blockbegin += nrecords) {
+        MSCRecords records = read_msc_view(mscfile, min(msc_block_records, ncorepoints - blockbegin));
+        nrecords = records.npts;
+        // see make_features for the transform of the (a,b) values
+        decode_msc_features(records, &mscdata[blockbegin * nscales*2], true);
         // forward-compatibility: we do not care for possibly extra parameters for now
-        for (int i=4; i<ptnparams; ++i) {
-            FloatType param;
-            mscfile.read((char*)&param, sizeof(FloatType));
+        StridedView<FloatType> x = records.param(0), y = records.param(1), z = records.param(2);
+        StridedView<FloatType> info = records.param(ptnparams>=4 ? 3 : 0);
+        // we care only for number of neighbors at max and min scales
+        StridedView<int> nneigh_max = records.nneigh(0), nneigh_min = records.nneigh(nscales-1);
+#pragma omp parallel for schedule(static)
+        for (int i=0; i<records.npts; ++i) {
+            int pt = blockbegin + i;
+            coreCloud.data[pt].x = x[i];
+            coreCloud.data[pt].y = y[i];
+            coreCloud.data[pt].z = z[i];
+            if (ptnparams>=4) coreAdditionalInfo[pt] = info[i];
+            nneigh_max_scale[pt] = nneigh_max[i];
+            nneigh_min_scale[pt] = nneigh_min[i];
         }
-        coreCloud.xmin = min(coreCloud.xmin, coreCloud.data[pt].x);
-        coreCloud.xmax = max(coreCloud.xmax, coreCloud.data[pt].x);
-        coreCloud.ymin = min(coreCloud.ymin, coreCloud.data[pt].y);
-        coreCloud.ymax = max(coreCloud.ymax, coreCloud.data[pt].y);
-        for (int s=0; s<nscales_msc; ++s) {
-            FloatType a,b;
-            mscfile.read((char*)(&a), sizeof(FloatType));
-            mscfile.read((char*)(&b), sizeof(FloatType));
-            FloatType c = 1 - a - b;
-            // see make_features for this transform
-            FloatType x = b + c / 2;
-            FloatType y = c * sqrt(3)/2;
-            mscdata[pt * nscales_msc*2 + s*2  ] = x;
-            mscdata[pt * nscales_msc*2 + s*2+1] = y;
+        for (int i=0; i<records.npts; ++i) {
+            coreCloud.xmin = min(coreCloud.xmin, x[i]);
+            coreCloud.xmax = max(coreCloud.xmax, x[i]);
+            coreCloud.ymin = min(coreCloud.ymin, y[i]);
+            coreCloud.ymax = max(coreCloud.ymax, y[i]);
         }
-        // we care only for number of neighbors at max and min scales
-        mscfile.read((char*)&nneigh_max_scale[pt], sizeof(int));
-        int numneigh;
-        for (int i=1; i<nscales; ++i) mscfile.read((char*)&numneigh, sizeof(int));
-        nneigh_min_scale[pt] = numneigh;
-/*        FloatType foof;
-        mscfile.read((char*)&avg_ndist_max_scale[pt], sizeof(FloatType));
-        for (int i=1; i<nscales; ++i) mscfile.read((char*)&foof, sizeof(FloatType));*/
     }
-    mscfile.close();
     // complete the coreCloud structure by setting the grid
     FloatType sizex = coreCloud.xmax - coreCloud.xmin;
     FloatType sizey = coreCloud.ymax - coreCloud.ymin;
@@ -254,14 +257,44 @@ int main(int argc, char** argv) {
         coreCloud.grid[celly * coreCloud.ncellx + cellx] = pt;
     }
     
-    cout << "Loading scene data" << endl;
+    // the whole scene is needed only for the extra information, otherwise it is streamed
+    // through the labelling phase by chunks
+    bool use_extra_info = usage_flag==1 && dist_to_decision_boundary>0;
+    TextChunkReader scenestream(argv[2]);
+    if (!scenestream.ok()) {
+        cerr << "Could not load file: " << argv[2] << endl;
+        return 1;
+    }
+    // every scene point is labelled with its nearest core point
+    if (ncorepoints<=0) {
+        cerr << "Invalid core point file." << endl;
+        return 1;
+    }
     PointCloud<Point> sceneCloud;
     vector<vector<FloatType> > sceneAdditionalInfo;
-    sceneCloud.load_txt(argv[2], &sceneAdditionalInfo);
-    
-    cout << "Processing scene data" << endl;
-    ofstream scene_annotated(argv[4]);
-    scene_annotated.precision(20);
+    int nscenepts = 0;
+    vector<int> scenenearest;
+    // inverse index: the scene points of core point i are corescenepts[corescenebegin[i]..corescenebegin[i+1]-1]
+    vector<int> corescenebegin, corescenepts;
+    if (use_extra_info) {
+        cout << "Loading scene data" << endl;
+        sceneCloud.load_txt(argv[2], &sceneAdditionalInfo);
+
+        cout << "Processing scene data" << endl;
+        // nearest core point of each scene point, for the extra information and the labelling
+        nscenepts = sceneCloud.data.size();
+        scenenearest.resize(nscenepts);
+        if (nscenepts>0) coreCloud.findNearestNeighbors(&sceneCloud.data[0], nscenepts, 1, &scenenearest[0]);
+        corescenebegin.assign(ncorepoints+1, 0);
+        for (int pt=0; pt<nscenepts; ++pt) ++corescenebegin[scenenearest[pt]+1];
+        for (int i=0; i<ncorepoints; ++i) corescenebegin[i+1] += corescenebegin[i];
+        corescenepts.resize(nscenepts);
+        vector<int> fillpos(corescenebegin.begin(), corescenebegin.end()-1);
+        for (int pt=0; pt<nscenepts; ++pt) corescenepts[fillpos[scenenearest[pt]]++] = pt;
+    }
+    int outnamelen = strlen(argv[4]);
+    bool binary_output = outnamelen>=4 && !strcmp(argv[4]+outnamelen-4, ".bin");
+    ofstream scene_annotated(argv[4], ofstream::binary);
 
 #ifdef CHECK_CLASSIFIER
     static const int svgSize = 800;
@@ -292,202 +325,191 @@ int main(int argc, char** argv) {
     // just to check we're not in an infinite loop
     int nidxtosearch = idxToSearch.size();
     do {
-#pragma omp parallel for
-        for (int itsi=0; itsi<idxToSearch.size(); ++itsi) {
-            int ptidx = idxToSearch[itsi];
-            map<int,int> votes;
-            map< pair<int,int>, FloatType > predictions;
-            map<int,FloatType> minconfidences;
-            bool unreliable = false;
-            // one-against-one process: apply all classifiers and vote for this point class
-            for (int ci=0; ci<nclassifiers; ++ci) {
-                FloatType pred = classifiers[ci].classify(&mscdata[ptidx*nscales*2]);
-                // uniformize the order, pred>0 selects the larger class of both
-                if (classifiers[ci].class1 > classifiers[ci].class2) pred = -pred;
-                int minclass = min(classifiers[ci].class1, classifiers[ci].class2);
-                int maxclass = max(classifiers[ci].class1, classifiers[ci].class2);
-                // use extra info when too close to the decision boundary
-                if (fabs(pred)<dist_to_decision_boundary && usage_flag==0) {
-                    unreliable = true;
+#pragma omp parallel
+        {
+            vector<FloatType> projab(projblock * projbank.nproj);
+            vector<FloatType> projpred(projblock * nclassifiers);
+            vector<int> votes(nclasses);
+            vector<FloatType> minconfidences(nclasses);
+#pragma omp for schedule(static, projblock)
+            for (int itsi=0; itsi<idxToSearch.size(); ++itsi) {
+                int ptidx = idxToSearch[itsi];
+                // static schedule by whole blocks: the first point of a block projects it all
+                if (itsi % projblock == 0) {
+                    int nblock = min(projblock, (int)idxToSearch.size() - itsi);
+                    projbank.project(&mscdata[0], nscales*2, &idxToSearch[itsi], nblock, &projab[0]);
+                    for (int ci=0; ci<nclassifiers; ++ci) classifiers[ci].classify2D(&projab[ci*2], nblock, projbank.nproj, &projpred[ci], nclassifiers);
                 }
-                else if (fabs(pred)<dist_to_decision_boundary && usage_flag==1) {
-                    // we've made sure above that both core and scene data have the extra info at this point
-                    // largest scale is the first by construction in canupo, order was preserved by the other programs
-                    FloatType largestScale = scales[0];
-                    vector<DistPoint<Point> > neighbors;
-                    vector<int> class1sceneidx;
-                    vector<int> class2sceneidx;
-                    // find all scene data around that core point
-                    sceneCloud.findNeighbors(back_inserter(neighbors), sceneCloud.data[ptidx], largestScale * 0.5); // take radius, not diameter
-                    // for each scene data point, find the corresponding core point and check if it is reliable
-                    for (int i=0; i<neighbors.size(); ++i) {
-                        int neighcoreidx = coreCloud.findNearest(*neighbors[i].pt);
-                        if (neighcoreidx==-1) {
-                            cerr << "Invalid core point file" << endl;
-                            exit(1);
-                        }
-                        if (coreCloud.data[neighcoreidx].reliable) {
-                            if (coreCloud.data[neighcoreidx].classif == minclass) class1sceneidx.push_back(neighbors[i].pt-&sceneCloud.data[0]);
-                            if (coreCloud.data[neighcoreidx].classif == maxclass) class2sceneidx.push_back(neighbors[i].pt-&sceneCloud.data[0]);
-                            // else the extra info is irrelevant for this classifier pair
-                        }
+                fill(votes.begin(), votes.end(), 0);
+                fill(minconfidences.begin(), minconfidences.end(), numeric_limits<FloatType>::max());
+                bool unreliable = false;
+                // one-against-one process: apply all classifiers and vote for this point class
+                for (int ci=0; ci<nclassifiers; ++ci) {
+                    FloatType pred = projpred[(itsi % projblock) * nclassifiers + ci];
+                    // uniformize the order, pred>0 selects the larger class of both
+                    if (classifiers[ci].class1 > classifiers[ci].class2) pred = -pred;
+                    int minclass = min(classifiers[ci].class1, classifiers[ci].class2);
+                    int maxclass = max(classifiers[ci].class1, classifiers[ci].class2);
+                    // use extra info when too close to the decision boundary
+                    if (fabs(pred)<dist_to_decision_boundary && usage_flag==0) {
+                        unreliable = true;
                     }
-                    // some local info ? TODO: min size for considering this information is reliable ?
-                    int nsamples = class1sceneidx.size() + class2sceneidx.size();
-                    if (nsamples>0) {
-                        // only one class ?
-                        if (class1sceneidx.size()==0) {
-                            if (class2sceneidx.size() * 2 > neighbors.size())
-                                pred = class2sceneidx.size() / (FloatType)nsamples;
-                            else unreliable = true;
+                    else if (fabs(pred)<dist_to_decision_boundary && usage_flag==1) {
+                        // we've made sure above that both core and scene data have the extra info at this point
+                        // largest scale is the first by construction in canupo, order was preserved by the other programs
+                        FloatType largestScale = scales[0];
+                        vector<NeighborIndex> coreneighbors;
+                        vector<int> class1sceneidx;
+                        vector<int> class2sceneidx;
+                        // find all scene data around that core point: these are the scene points
+                        // attached to the core points in that neighborhood
+                        coreCloud.findNeighborIndices(coreneighbors, coreCloud.data[ptidx], largestScale * 0.5); // take radius, not diameter
+                        int nsceneneighbors = 0;
+                        // for each of these core points, check if it is reliable
+                        for (int i=0; i<coreneighbors.size(); ++i) {
+                            int neighcoreidx = coreneighbors[i].idx;
+                            const int* scenebegin = &corescenepts[0] + corescenebegin[neighcoreidx];
+                            const int* sceneend = &corescenepts[0] + corescenebegin[neighcoreidx+1];
+                            nsceneneighbors += sceneend - scenebegin;
+                            if (coreCloud.data[neighcoreidx].reliable) {
+                                if (coreCloud.data[neighcoreidx].classif == minclass) class1sceneidx.insert(class1sceneidx.end(), scenebegin, sceneend);
+                                if (coreCloud.data[neighcoreidx].classif == maxclass) class2sceneidx.insert(class2sceneidx.end(), scenebegin, sceneend);
+                                // else the extra info is irrelevant for this classifier pair
+                            }
+                        }
+                        // some local info ? TODO: min size for considering this information is reliable ?
+                        int nsamples = class1sceneidx.size() + class2sceneidx.size();
+                        if (nsamples>0) {
+                            // only one class ?
+                            if (class1sceneidx.size()==0) {
+                                if (class2sceneidx.size() * 2 > nsceneneighbors)
+                                    pred = class2sceneidx.size() / (FloatType)nsamples;
+                                else unreliable = true;
 //cout << "only class 2" << endl;
-                        } else if (class2sceneidx.size()==0) {
-                            if (class1sceneidx.size() * 2 > neighbors.size())
-                                pred = -(class1sceneidx.size() / (FloatType)nsamples);
-                            else unreliable = true;
+                            } else if (class2sceneidx.size()==0) {
+                                if (class1sceneidx.size() * 2 > nsceneneighbors)
+                                    pred = -(class1sceneidx.size() / (FloatType)nsamples);
+                                else unreliable = true;
 //cout << "only class 1" << endl;
-                        }
-                        else {
-/*
-                            // nearest neighbor in either class
-                            FloatType x = coreAdditionalInfo[ptidx];
-                            FloatType dmin = numeric_limits<FloatType>::max();
-                            for (int i=0; i<class1sceneidx.size(); ++i) {
-                                FloatType d = fabs(sceneAdditionalInfo[class1sceneidx[i]]-x);
-                                if (d<dmin) d=dmin;
-                            }
-                            bool isClass1 = true;
-                            for (int i=0; i<class2sceneidx.size(); ++i) {
-                                FloatType d = fabs(sceneAdditionalInfo[class2sceneidx[i]]-x);
-                                if (d<dmin) {
-                                    d=dmin; isClass1 = false;
-                                    break; // closer points would only improve the decision, now class2
-                                }
-                            }
-                            if (isClass1) pred = -class1sceneidx.size() / (FloatType)nsamples;
-                            else pred = class2sceneidx.size() / (FloatType)nsamples;
-*/
-                            vector<FloatType> info1(class1sceneidx.size());
-                            for (int i=0; i<class1sceneidx.size(); ++i) info1[i] = sceneAdditionalInfo[class1sceneidx[i]][0];
-                            vector<FloatType> info2(class2sceneidx.size());
-                            for (int i=0; i<class2sceneidx.size(); ++i) info2[i] = sceneAdditionalInfo[class2sceneidx[i]][0];
-                            sort(info1.begin(), info1.end());
-                            sort(info2.begin(), info2.end());
-                            vector<FloatType>* smallestvec, * largestvec;
-                            if (class1sceneidx.size()<class2sceneidx.size()) {
-                                smallestvec = &info1;
-                                largestvec = &info2;
-                            } else {
-                                smallestvec = &info2;
-                                largestvec = &info1;
                             }
-                            vector<FloatType> bestSplit;
-                            vector<int> bestSplitDir;
-                            FloatType bestclassif = -1;
-                            for (int i=0; i<smallestvec->size(); ++i) {
-                                int dichofirst = 0;
-                                int dicholast = largestvec->size();
-                                int dichomed;
-                                while (true) {
-                                    dichomed = (dichofirst + dicholast) / 2;
-                                    if (dichomed==dichofirst) break;
-                                    if (info1[i]==info2[dichomed]) break;
-                                    if (info1[i]<info2[dichomed]) { dicholast = dichomed; continue;}
-                                    dichofirst = dichomed;
+                            else {
+    /*
+                                // nearest neighbor in either class
+                                FloatType x = coreAdditionalInfo[ptidx];
+                                FloatType dmin = numeric_limits<FloatType>::max();
+                                for (int i=0; i<class1sceneidx.size(); ++i) {
+                                    FloatType d = fabs(sceneAdditionalInfo[class1sceneidx[i]]-x);
+                                    if (d<dmin) d=dmin;
                                 }
-                                // dichomed is now the last index with info2 below or equal to info1[i],
-                                int nlabove = largestvec->size() - 1 - dichomed;
-                                int nsbelow = i;
-                                // or possibly all if info1[i] is too low
-                                if ((*smallestvec)[i]<(*largestvec)[dichomed]) {
-                                    // shall happen only if dichomed==0, sorted vecs
-                                    assert(dichomed==0);
-                                    nlabove = largestvec->size();
-                                    nsbelow = i+1;
+                                bool isClass1 = true;
+                                for (int i=0; i<class2sceneidx.size(); ++i) {
+                                    FloatType d = fabs(sceneAdditionalInfo[class2sceneidx[i]]-x);
+                                    if (d<dmin) {
+                                        d=dmin; isClass1 = false;
+                                        break; // closer points would only improve the decision, now class2
+                                    }
                                 }
-                                // classification on either side, take largest and reverse roles if necessary
-                                FloatType c1 = nlabove / (FloatType)largestvec->size() + nsbelow / (FloatType)smallestvec->size();
-                                FloatType c2 = (largestvec->size()-nlabove) / (FloatType)largestvec->size() + (smallestvec->size()-nsbelow)/ (FloatType)smallestvec->size();
-                                FloatType classif = max(c1,c2);
-                                // no need to average for comparison purpose
-                                if (bestclassif < classif) {
-                                    bestSplit.clear(); bestSplitDir.clear();
-                                    bestclassif = classif;
+                                if (isClass1) pred = -class1sceneidx.size() / (FloatType)nsamples;
+                                else pred = class2sceneidx.size() / (FloatType)nsamples;
+    */
+                                vector<FloatType> info1(class1sceneidx.size());
+                                for (int i=0; i<class1sceneidx.size(); ++i) info1[i] = sceneAdditionalInfo[class1sceneidx[i]][0];
+                                vector<FloatType> info2(class2sceneidx.size());
+                                for (int i=0; i<class2sceneidx.size(); ++i) info2[i] = sceneAdditionalInfo[class2sceneidx[i]][0];
+                                sort(info1.begin(), info1.end());
+                                sort(info2.begin(), info2.end());
+                                vector<FloatType>* smallestvec, * largestvec;
+                                if (class1sceneidx.size()<class2sceneidx.size()) {
+                                    smallestvec = &info1;
+                                    largestvec = &info2;
+                                } else {
+                                    smallestvec = &info2;
+                                    largestvec = &info1;
                                 }
-                                if (fpeq(bestclassif,classif)) {
-                                    bestSplit.push_back(((*smallestvec)[i]+(*largestvec)[dichomed])*0.5);
-                                    bestSplitDir.push_back((int)(c1<=c2));
+                                vector<FloatType> bestSplit;
+                                vector<int> bestSplitDir;
+                                FloatType bestclassif = -1;
+                                for (int i=0; i<smallestvec->size(); ++i) {
+                                    int dichofirst = 0;
+                                    int dicholast = largestvec->size();
+                                    int dichomed;
+                                    while (true) {
+                                        dichomed = (dichofirst + dicholast) / 2;
+                                        if (dichomed==dichofirst) break;
+                                        if (info1[i]==info2[dichomed]) break;
+                                        if (info1[i]<info2[dichomed]) { dicholast = dichomed; continue;}
+                                        dichofirst = dichomed;
+                                    }
+                                    // dichomed is now the last index with info2 below or equal to info1[i],
+                                    int nlabove = largestvec->size() - 1 - dichomed;
+                                    int nsbelow = i;
+                                    // or possibly all if info1[i] is too low
+                                    if ((*smallestvec)[i]<(*largestvec)[dichomed]) {
+                                        // shall happen only if dichomed==0, sorted vecs
+                                        assert(dichomed==0);
+                                        nlabove = largestvec->size();
+                                        nsbelow = i+1;
+                                    }
+                                    // classification on either side, take largest and reverse roles if necessary
+                                    FloatType c1 = nlabove / (FloatType)largestvec->size() + nsbelow / (FloatType)smallestvec->size();
+                                    FloatType c2 = (largestvec->size()-nlabove) / (FloatType)largestvec->size() + (smallestvec->size()-nsbelow)/ (FloatType)smallestvec->size();
+                                    FloatType classif = max(c1,c2);
+                                    // no need to average for comparison purpose
+                                    if (bestclassif < classif) {
+                                        bestSplit.clear(); bestSplitDir.clear();
+                                        bestclassif = classif;
+                                    }
+                                    if (fpeq(bestclassif,classif)) {
+                                        bestSplit.push_back(((*smallestvec)[i]+(*largestvec)[dichomed])*0.5);
+                                        bestSplitDir.push_back((int)(c1<=c2));
+                                    }
                                 }
-                            }
-                            bestclassif *= 0.5;
-                            // see if we're improving estimated probability or not
-                            FloatType oriprob = 1 / (1+exp(-fabs(pred)));
+                                bestclassif *= 0.5;
+                                // see if we're improving estimated probability or not
+                                FloatType oriprob = 1 / (1+exp(-fabs(pred)));
 // TODO: sometimes (rarely) there are mistakes in the reference core points and we're dealing with similar classes
 // => put back these core points in the unreliable pool
 //cout << (oriprob < bestclassif?"OK: ":"NO: ") << bestclassif << " vs " << oriprob << endl;
-                            if (oriprob < bestclassif) {
-                                // take median best split
-                                int bsi = bestSplit.size()/2;
-                                pred = coreAdditionalInfo[ptidx] - bestSplit[bsi];
-                                // reverse if necessary
-                                if (bestSplitDir[bsi]==1) pred = -pred;
-                                // back to original vectors
-                                if (class1sceneidx.size()>=class2sceneidx.size()) pred = -pred;
-                            } else unreliable = true;
+                                if (oriprob < bestclassif) {
+                                    // take median best split
+                                    int bsi = bestSplit.size()/2;
+                                    pred = coreAdditionalInfo[ptidx] - bestSplit[bsi];
+                                    // reverse if necessary
+                                    if (bestSplitDir[bsi]==1) pred = -pred;
+                                    // back to original vectors
+                                    if (class1sceneidx.size()>=class2sceneidx.size()) pred = -pred;
+                                } else unreliable = true;
                             
+                            }
                         }
+                        else unreliable = true;
                     }
-                    else unreliable = true;
-                }
-                if (unreliable) break;
-                FloatType confidence = 1.0 / (exp(-fabs(pred))+1.0);
-                int theclass = minclass;
-                if (pred>=0) theclass = maxclass;
-                ++votes[theclass];
-                // simply maintain the min confidence for each class
-                // and we'll use that for the best vote below
-                // for our application this is enough
-                if (minconfidences.find(theclass)==minconfidences.end()) {
-                    minconfidences[theclass] = confidence;
-                } else {
-                    if (confidence<minconfidences[theclass]) minconfidences[theclass] = confidence;
-                }
-                predictions[make_pair(minclass, maxclass)] = pred;
-            }
-            if (unreliable) continue; // no classification
-
-            // search for max vote
-            vector<int> bestclasses;
-            int maxvote = -1;
-            for (map<int,int>::iterator it = votes.begin(); it!=votes.end(); ++it) {
-                int vclass = it->first;
-                int vote = it->second;
-                if (maxvote < vote) {
-                    bestclasses.clear();
-                    bestclasses.push_back(vclass);
-                    maxvote = vote;
-                } else if (maxvote == vote) {
-                    bestclasses.push_back(vclass);
+                    if (unreliable) break;
+                    FloatType confidence = 1.0 / (exp(-fabs(pred))+1.0);
+                    int theclass = pred>=0 ? maxclassidx[ci] : minclassidx[ci];
+                    ++votes[theclass];
+                    // simply maintain the min confidence for each class
+                    // and we'll use that for the best vote below
+                    // for our application this is enough
+                    minconfidences[theclass] = min(minconfidences[theclass], confidence);
                 }
-            }
+                if (unreliable) continue; // no classification
 
-            // only one class => do not bother with tie breaking
-            if (bestclasses.size()==1) {
-                coreCloud.data[ptidx].classif = bestclasses[0]; 
-                coreCloud.data[ptidx].confidence = minconfidences[bestclasses[0]];
-            }
-            else {
-                // in case equality = use the distances from the decision boundary
+                // search for max vote, in case equality use the distances from the decision boundary:
                 // take the max vote class that has also farthest min dist
-                FloatType max_minc = minconfidences[bestclasses[0]];
-                int selectedclass = bestclasses[0];
-                for (int j=1; j<bestclasses.size(); ++j) {
-                    if (minconfidences[bestclasses[j]]>max_minc) {
-                        max_minc = minconfidences[bestclasses[j]];
-                        selectedclass = bestclasses[j];
+                int maxvote = 0;
+                FloatType max_minc = 0;
+                int selectedclass = -1;
+                for (int c=0; c<nclasses; ++c) {
+                    if (votes[c]==0) continue;
+                    if (maxvote < votes[c] || (maxvote == votes[c] && minconfidences[c] > max_minc)) {
+                        maxvote = votes[c];
+                        max_minc = minconfidences[c];
+                        selectedclass = c;
                     }
                 }
-                coreCloud.data[ptidx].classif = selectedclass;
+                if (selectedclass==-1) continue;
+                coreCloud.data[ptidx].classif = classlabels[selectedclass];
                 coreCloud.data[ptidx].confidence = max_minc;
             }
         }
@@ -519,36 +541,97 @@ int main(int argc, char** argv) {
     cout << endl;
     cout << "The first 3 values are those of the scene point (x,y,z), the other values are taken from the nearest core point to this scene point" << endl;
 
-    for (int pt=0; pt<sceneCloud.data.size(); ++pt) {
-        Point& point = sceneCloud.data[pt];
-        // process this point
-        // first look for the nearest neighbor in core points
-        int neighidx = coreCloud.findNearest(point);
-        if (neighidx==-1) {
-            cerr << "Invalid core point file." << endl;
-            return 1;
-        }
-        // assign the scene point to this core point class, which was computed before
-        scene_annotated << point.x << " " << point.y << " " << point.z;
-        scene_annotated << " " << coreCloud.data[neighidx].classif;
-        scene_annotated << " " << coreCloud.data[neighidx].confidence;
-        scene_annotated << " " << nneigh_min_scale[neighidx];
-        scene_annotated << " " << nneigh_max_scale[neighidx];
-        //scene_annotated << " " << avg_ndist_max_scale[neighidx];
-        if (!coreAdditionalInfo.empty()) scene_annotated << " " << coreAdditionalInfo[neighidx];
-        scene_annotated << endl;
+    // label the scene points by chunks, each formatted in a per-thread buffer and written in order
+    int hasextra = coreAdditionalInfo.empty() ? 0 : 1;
+    if (binary_output) {
+        scene_annotated.write((char*)&nscenepts, sizeof(int));
+        scene_annotated.write((char*)&hasextra, sizeof(int));
+    }
+    static const int labelchunk = 16384;
+    // max text line size: 5 reals and 3 integers, with their separators
+    static const int maxlinesize = 8 * format_max_chars;
+    const int recordsize = 5 * sizeof(FloatType) + 3 * sizeof(int);
+    auto label_points = [&](const Point* points, const int* nearest, int npts) {
+        int nlabelchunks = (npts + labelchunk - 1) / labelchunk;
+#pragma omp parallel
+        {
+            vector<char> outbuf(labelchunk * max(maxlinesize, recordsize));
+#pragma omp for ordered schedule(dynamic,1)
+            for (int chunk=0; chunk<nlabelchunks; ++chunk) {
+                int begin = chunk * labelchunk;
+                int end = min(begin + labelchunk, npts);
+                char* p = &outbuf[0];
+                for (int pt=begin; pt<end; ++pt) {
+                    const Point& point = points[pt];
+                    int neighidx = nearest[pt];
+                    // assign the scene point to this core point class, which was computed before
+                    if (binary_output) {
+                        memcpy(p, &point.x, sizeof(FloatType)); p += sizeof(FloatType);
+                        memcpy(p, &point.y, sizeof(FloatType)); p += sizeof(FloatType);
+                        memcpy(p, &point.z, sizeof(FloatType)); p += sizeof(FloatType);
+                        memcpy(p, &coreCloud.data[neighidx].classif, sizeof(int)); p += sizeof(int);
+                        memcpy(p, &coreCloud.data[neighidx].confidence, sizeof(FloatType)); p += sizeof(FloatType);
+                        memcpy(p, &nneigh_min_scale[neighidx], sizeof(int)); p += sizeof(int);
+                        memcpy(p, &nneigh_max_scale[neighidx], sizeof(int)); p += sizeof(int);
+                        if (hasextra) {memcpy(p, &coreAdditionalInfo[neighidx], sizeof(FloatType)); p += sizeof(FloatType);}
+                        continue;
+                    }
+                    p = format_real(p, point.x); *p++ = ' ';
+                    p = format_real(p, point.y); *p++ = ' ';
+                    p = format_real(p, point.z); *p++ = ' ';
+                    p = format_int(p, coreCloud.data[neighidx].classif); *p++ = ' ';
+                    p = format_real(p, coreCloud.data[neighidx].confidence); *p++ = ' ';
+                    p = format_int(p, nneigh_min_scale[neighidx]); *p++ = ' ';
+                    p = format_int(p, nneigh_max_scale[neighidx]);
+                    if (hasextra) {*p++ = ' '; p = format_real(p, coreAdditionalInfo[neighidx]);}
+                    *p++ = '\n';
+                }
+#pragma omp ordered
+                {
+                    scene_annotated.write(&outbuf[0], p - &outbuf[0]);
 #ifdef CHECK_CLASSIFIER
-        FloatType a,b;
-        FloatType scaleFactor = svgSize/2 / classifiers[0].absmaxXY;
-        classifiers[0].project(&mscdata[neighidx*nscales*2],a,b);
-        if (coreCloud.data[neighidx].classif==1) cairo_set_source_rgba(cr, 0, 0, 1, 0.75);
-        else if (coreCloud.data[neighidx].classif==2) cairo_set_source_rgba(cr, 1, 0, 0, 0.75);
-        else cairo_set_source_rgba(cr, 0, 1, 0, 0.75);
-        FloatType x = a*scaleFactor + svgSize/2;
-        FloatType y = svgSize/2 - b*scaleFactor;
-        cairo_arc(cr, x, y, 0.714, 0, 2*M_PI);
-        cairo_stroke(cr);
+                    for (int pt=begin; pt<end; ++pt) {
+                        int neighidx = nearest[pt];
+                        FloatType a,b;
+                        FloatType scaleFactor = svgSize/2 / classifiers[0].absmaxXY;
+                        classifiers[0].project(&mscdata[neighidx*nscales*2],a,b);
+                        if (coreCloud.data[neighidx].classif==1) cairo_set_source_rgba(cr, 0, 0, 1, 0.75);
+                        else if (coreCloud.data[neighidx].classif==2) cairo_set_source_rgba(cr, 1, 0, 0, 0.75);
+                        else cairo_set_source_rgba(cr, 0, 1, 0, 0.75);
+                        FloatType x = a*scaleFactor + svgSize/2;
+                        FloatType y = svgSize/2 - b*scaleFactor;
+                        cairo_arc(cr, x, y, 0.714, 0, 2*M_PI);
+                        cairo_stroke(cr);
+                    }
 #endif
+                }
+            }
+        }
+    };
+    if (use_extra_info) {
+        if (nscenepts>0) label_points(&sceneCloud.data[0], &scenenearest[0], nscenepts);
+    } else {
+        // parse -> nearest core point -> format pipeline, with bounded memory
+        static const int streamchunk = 1 << 20;
+        vector<char> text;
+        vector<size_t> offsets;
+        vector<Point> chunkpts;
+        vector<int> chunknearest;
+        int nlines;
+        while ((nlines = scenestream.read(streamchunk, text, offsets)) > 0) {
+            chunkpts.resize(nlines);
+            chunknearest.resize(nlines);
+#pragma omp parallel for schedule(dynamic, 4096)
+            for (int i=0; i<nlines; ++i) parse_point_line(&text[offsets[i]], chunkpts[i]);
+            coreCloud.findNearestNeighbors(&chunkpts[0], nlines, 1, &chunknearest[0]);
+            label_points(&chunkpts[0], &chunknearest[0], nlines);
+            nscenepts += nlines;
+        }
+        // the number of points is known only now
+        if (binary_output) {
+            scene_annotated.seekp(0);
+            scene_annotated.write((char*)&nscenepts, sizeof(int));
+        }
     }
     scene_annotated.close();
 
@@ -34,15 +34,19 @@
 #include "points.hpp"
 #include "predictors.hpp"
 #include "helpers.hpp"
+#include "rasterplot.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 using namespace boost;
 
 const int svgSize=800;
 
-string hueToRGBstring(FloatType hue) {
+void hueToRGB(FloatType hue, int& r, int& g, int& b) {
     hue = 6.0f * (hue - floorf(hue)); // 0 <= hue < 1
-    int r,g,b;
     if (hue < 1.0f) {
         r=255; b=0;
         g = (int)(255.999 * hue);
@@ -67,18 +71,16 @@ string hueToRGBstring(FloatType hue) {
         r=255; g=0;
         b = (int)(255.999 * (6.0f-hue));
     }
-    char ret[8];
-    snprintf(ret,8,"#%02X%02X%02X",r,g,b);
-    return ret;
 }
 
-string scaleColorMap(const int* density, const vector<FloatType>& lmind, const vector<FloatType>& lmaxd, bool hasUnlabelled) {
+void scaleColorMap(const int* density, const vector<FloatType>& lmind, const vector<FloatType>& lmaxd, bool hasUnlabelled, int& r, int& g, int& b) {
     // log transform. min>=0 by construction, so add 1 to take log
     if (lmind.size()==1) {
         // single class : from blue to red
         FloatType d = (log(density[0]+1) - lmind[0]) / (lmaxd[0] - lmind[0]);
         // low value = blue(hue=4/6), high = red(hue=0)
-        return hueToRGBstring(FloatType(4)/FloatType(6)*(1-d));
+        hueToRGB(FloatType(4)/FloatType(6)*(1-d), r, g, b);
+        return;
     }
 
     // one color per class, density is the amount of that color
@@ -94,10 +96,6 @@ string scaleColorMap(const int* density, const vector<FloatType>& lmind, const v
         0,0,1,  // class 5 = yellow
     };
     int nclasses = lmind.size();
-    if (nclasses>6+(int)hasUnlabelled) {
-        cerr << "Sorry, displaying more than 6 classes is not supported for now" << endl;
-        exit(1);
-    }
     FloatType color[] = {0,0,0};
     // convert the densities to log space and between 0 and 1 for each class first
     for (int i=0; i<nclasses; ++i) {
@@ -106,18 +104,66 @@ string scaleColorMap(const int* density, const vector<FloatType>& lmind, const v
     }
     // bound check and take complement
     for (int j=0; j<3; ++j) color[j] = 1 - min(1.0, max((double)color[j], 0.0));
+    r = (int)(color[0]*255.99); g = (int)(color[1]*255.99); b = (int)(color[2]*255.99);
+}
+
+string scaleColorString(const int* density, const vector<FloatType>& lmind, const vector<FloatType>& lmaxd, bool hasUnlabelled) {
+    int r,g,b;
+    scaleColorMap(density, lmind, lmaxd, hasUnlabelled, r, g, b);
     char ret[8];
-    snprintf(ret,8,"#%02X%02X%02X",(int)(color[0]*255.99),(int)(color[1]*255.99),(int)(color[2]*255.99));
+    snprintf(ret,8,"#%02X%02X%02X",r,g,b);
     return ret;
 }
 
+// Pixel version of the svg plot, with the same geometry: row v of cells from the bottom,
+// and u along the rows, skewed so the cells of a row are at u in [x,x+1]
+// The lower cell (x,y) has u-x >= v-y, the upper one u-x < v-y
+void rasterize_density(RasterImage& img, const int* density, int nsubdiv, int nclasses, const vector<FloatType>& lmind, const vector<FloatType>& lmaxd, bool hasUnlabelled) {
+    int ncells = nsubdiv*(nsubdiv+1);
+    vector<unsigned char> cellcolors(ncells * 3);
+    for (int cellidx = 0; cellidx < ncells; ++cellidx) {
+        int r,g,b;
+        scaleColorMap(&density[cellidx * nclasses], lmind, lmaxd, hasUnlabelled, r, g, b);
+        cellcolors[cellidx*3] = r; cellcolors[cellidx*3+1] = g; cellcolors[cellidx*3+2] = b;
+    }
+    static const double sin60 = 0.866025403784439;
+    double scaleFactor = svgSize / double(nsubdiv+1);
+    double top = (nsubdiv+0.5)*scaleFactor*sin60;
+    double rowHeight = scaleFactor * sin60;
+#pragma omp parallel for schedule(static)
+    for (int py = 0; py < img.height; ++py) {
+        double v = (top - (py + 0.5)) / scaleFactor / sin60;
+        for (int px = 0; px < img.width; ++px) {
+            double u = (px + 0.5) / scaleFactor + 0.5 * v;
+            // distances to the triangle sides in pixels, positive inside
+            double dbottom = v * rowHeight;
+            double dright = (nsubdiv - u) * rowHeight;
+            double dleft = (u - v) * rowHeight;
+            double dmin = min(dbottom, min(dright, dleft));
+            if (dmin < -0.5) continue;
+            // the 1px outline
+            if (dmin <= 0.5) {img.set(px, py, 0, 0, 0); continue;}
+            int y = min((int)floor(v), nsubdiv-1);
+            int x = min((int)floor(u), nsubdiv-1);
+            int upper = (u - x) < (v - y);
+            if (y>=x) {y = x; upper = 0;}
+            const unsigned char* c = &cellcolors[((x*(x+1)/2 + y)*2 + upper) * 3];
+            img.set(px, py, c[0], c[1], c[2]);
+        }
+    }
+}
+
 int help(const char* errmsg = 0) {
     if (errmsg) cout << "Error: " << errmsg << endl;
 cout << "\
-density nsubdiv nametag [some scales] [: unlabeled.msc] : data.msc [ - data2.msc ...]\n\
+density nsubdiv nametag[=format] [some scales] [: unlabeled.msc] : data.msc [ - data2.msc ...]\n\
   input: nsubdiv               # Number of subdivisions on each side of the triangle\n\
   input: nametag               # The base name for the output files. One density plot is\n\
                                # generated per selected scale, named \"nametag_scale.svg\"\n\
+  input: format                # svg (default): one polygon per cell, for editing the plot.\n\
+                               # png: \"nametag_scale.png\" images, much faster for large nsubdiv.\n\
+                               # sheet: all scales side by side in a single \"nametag_sheet.png\" image.\n\
+                               # svgpng: the png images embedded in svg files, for annotating them.\n\
   input: some scales           # Selected scales at which to perform the density plot\n\
                                # All scales in the parameter file are used if not specified.\n\
   input: data.msc              # The multiscale parameters computed by canupo.\n\
@@ -138,6 +184,17 @@ int main(int argc, char** argv) {
     if (nsubdiv<=0) return help();
 
     string nametag = argv[2];
+    // output format, svg polygons by default
+    string format = "svg";
+    // only a known format is taken from the suffix, the nametag may itself contain '='
+    size_t formatpos = nametag.rfind('=');
+    if (formatpos!=string::npos) {
+        string suffix = nametag.substr(formatpos+1);
+        if (suffix=="svg" || suffix=="png" || suffix=="sheet" || suffix=="svgpng") {
+            format = suffix;
+            nametag = nametag.substr(0, formatpos);
+        }
+    }
 
     int separator = 0;
     for (int i=3; i<argc; ++i) if (!strcmp(":",argv[i])) {
@@ -188,8 +245,6 @@ int main(int argc, char** argv) {
     
     // now process the multiscale files and possibly multiple classes
     int nclasses = 1;
-    vector<int> classboundaries(1,0);
-    int total_pts = 0;
     int ptnparams;
 
     cout << "reading file headers" << endl;
@@ -199,20 +254,20 @@ int main(int argc, char** argv) {
     for (int argi = separator+1; argi<argc; ++argi) {
         if (!strcmp("-",argv[argi]) || !strcmp(":",argv[argi])) {
             ++nclasses;
-            classboundaries.push_back(total_pts);
             continue;
         }
         
         MSCFile mscfile(argv[argi]);
         // read the file header
-        int npts = read_msc_header(mscfile, scales, ptnparams);
-        total_pts += npts;
+        read_msc_header(mscfile, scales, ptnparams);
     }
-    classboundaries.push_back(total_pts);
     
     int nscales = scales.size();
-    // number of features
-    int fdim = scales.size() * 2;
+
+    if (nclasses>6+(int)hasUnlabelled && nclasses>1) {
+        cerr << "Sorry, displaying more than 6 classes is not supported for now" << endl;
+        exit(1);
+    }
     
     //if (scalesSet.empty()) return help();
     if (scalesSet.empty()) {
@@ -235,66 +290,90 @@ int main(int argc, char** argv) {
     for (int i=0; i<(int)scales.size(); ++i) cout << " " << scales[i];
     cout << endl;
     
-    cout << "reading data in memory" << endl;
-    
-    // Second pass: store all selected scale data in memory
-    vector<FloatType> data(total_pts * fdim);
-    int base_pt = 0;
-    // and then fill data from the files
+    // only the selected scales are binned
+    vector<int> selectedscales;
+    for (int si=0; si<nscales; ++si) {
+        for (auto f : scalesSet) {
+            if (fpeq(f,scales[si])) {selectedscales.push_back(si); break;}
+        }
+    }
+    int nselected = selectedscales.size();
+
+    // one density entry per selected scale per class - init all counts to 0
+    int ncells = nsubdiv*(nsubdiv+1);
+    int histsize = nselected * ncells * nclasses;
+    vector<int> density(histsize, 0);
+
+    cout << "building the density map" << endl;
+
+    // the records are streamed from the files by blocks, and binned in per-thread histograms
+    int nthreads = 1;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    vector<int> threaddensity(nthreads * histsize, 0);
+    static const int block_records = 1<<16;
+    int ci = 0;
     for (int argi = separator+1; argi<argc; ++argi) {
-        if (!strcmp("-",argv[argi]) || !strcmp(":",argv[argi])) continue;
+        if (!strcmp("-",argv[argi]) || !strcmp(":",argv[argi])) {++ci; continue;}
         MSCFile mscfile(argv[argi]);
         vector<FloatType> scales_dummy;
         // read the file header again
         int npts = read_msc_header(mscfile, scales_dummy, ptnparams);
-        // read data
-        read_msc_data(mscfile,nscales,npts,&data[base_pt * fdim], ptnparams);
-        base_pt += npts;
-    }
-    
-    // one density entry per selected scale per class - init all counts to 0
-    int ncells = nsubdiv*(nsubdiv+1);
-    vector<int> density(nscales * ncells * nclasses, 0);
-    
-    cout << "building the density map" << endl;
-    
-    for (int ci = 0; ci<nclasses; ++ci) for (int pt=classboundaries[ci]; pt<classboundaries[ci+1]; ++pt) {
-        FloatType* mscdata = &data[pt*fdim];
-        for (int si=0; si<nscales; ++si) {
-            FloatType a = mscdata[si * 2];
-            FloatType b = mscdata[si * 2 + 1];
-            // Density plot of (a,b) points: discretize the triangle and count how many points are in each cell
-            // Barycentric coordinates : a * (0,0) + b * (1,0) + (1-a-b) * (1,1)
-            FloatType c = nsubdiv * (1-a);
-            FloatType d = nsubdiv * (1-a-b);
-            int cellx = (int)floor(c);
-            int celly = (int)floor(d);
-            int lower = (c - cellx) > (d - celly);
-            if (cellx>=nsubdiv) {cellx=nsubdiv-1; lower = 1;}
-            if (cellx<0) {cellx=0; lower = 1;}
-            if (celly>=nsubdiv) {celly=nsubdiv-1; lower = 1;} // upper triangle cell = lower one
-            if (celly<0) {celly=0; lower = 1;}
-            if (celly>cellx) {celly=cellx; lower = 1;}
-            int cellidx = ((cellx * (cellx+1) / 2) + celly) * 2 + lower;
-            ++density[si * (ncells * nclasses) + cellidx * nclasses + ci];
+        int nrecords;
+        for (int blockbegin = 0; blockbegin < npts; blockbegin += nrecords) {
+            // only the columns of the selected scales are read
+            MSCRecords block = read_msc_columns(mscfile, blockbegin, min(block_records, npts - blockbegin), selectedscales);
+            nrecords = block.npts;
+#pragma omp parallel for schedule(static)
+            for (int rec = 0; rec < nrecords; ++rec) {
+                int thread = 0;
+#ifdef _OPENMP
+                thread = omp_get_thread_num();
+#endif
+                int* hist = &threaddensity[thread * histsize];
+                for (int sel=0; sel<nselected; ++sel) {
+                    FloatType a = block.a(sel)[rec];
+                    FloatType b = block.b(sel)[rec];
+                    // Density plot of (a,b) points: discretize the triangle and count how many points are in each cell
+                    // Barycentric coordinates : a * (0,0) + b * (1,0) + (1-a-b) * (1,1)
+                    FloatType c = nsubdiv * (1-a);
+                    FloatType d = nsubdiv * (1-a-b);
+                    int cellx = (int)floor(c);
+                    int celly = (int)floor(d);
+                    int lower = (c - cellx) > (d - celly);
+                    if (cellx>=nsubdiv) {cellx=nsubdiv-1; lower = 1;}
+                    if (cellx<0) {cellx=0; lower = 1;}
+                    if (celly>=nsubdiv) {celly=nsubdiv-1; lower = 1;} // upper triangle cell = lower one
+                    if (celly<0) {celly=0; lower = 1;}
+                    if (celly>cellx) {celly=cellx; lower = 1;}
+                    int cellidx = ((cellx * (cellx+1) / 2) + celly) * 2 + lower;
+                    ++hist[sel * (ncells * nclasses) + cellidx * nclasses + ci];
+                }
+            }
         }
-        
     }
-    
+    // merge the thread histograms
+    for (int thread = 0; thread < nthreads; ++thread) {
+        for (int i = 0; i < histsize; ++i) density[i] += threaddensity[thread * histsize + i];
+    }
+
     cout << "outputting result files" << endl;
-    for (int si=0; si<nscales; ++si) {
-        bool is_selected = false;
-        for (auto f : scalesSet) {
-            if (fpeq(f,scales[si])) {is_selected = true; break;}
-        }
-        if (!is_selected) continue;
-        
+    // same size as the svg
+    RasterImage plot(svgSize, (int)ceil(svgSize*sqrt(3)/2));
+    // the sprite sheet has the scales in rows of sheetcols plots
+    int sheetcols = (int)ceil(sqrt((double)nselected));
+    RasterImage sheet;
+    if (format=="sheet") sheet.resize(sheetcols * plot.width, (nselected + sheetcols - 1) / sheetcols * plot.height);
+    for (int sel=0; sel<nselected; ++sel) {
+        int si = selectedscales[sel];
+
         vector<int> minDensity(nclasses, numeric_limits<int>::max());
         vector<int> maxDensity(nclasses, 0);
     
         for (int cellidx = 0; cellidx < ncells; ++cellidx) {
             for (int ci = 0; ci < nclasses; ++ci) {
-                int d = density[si * (ncells * nclasses) + cellidx * nclasses + ci];
+                int d = density[sel * (ncells * nclasses) + cellidx * nclasses + ci];
                 minDensity[ci] = min(minDensity[ci], d);
                 maxDensity[ci] = max(maxDensity[ci], d);
             }
@@ -309,7 +388,21 @@ int main(int argc, char** argv) {
         
         stringstream filename;
         filename.precision(5);
-        filename << nametag << "_" << scales[si] << ".svg";
+        filename << nametag << "_" << scales[si] << (format=="png" ? ".png" : ".svg");
+
+        if (format!="svg") {
+            plot.resize(plot.width, plot.height);
+            rasterize_density(plot, &density[sel * (ncells * nclasses)], nsubdiv, nclasses, logMinDensity, logMaxDensity, hasUnlabelled);
+            if (format=="sheet") {
+                sheet.blit(plot, (sel % sheetcols) * plot.width, (sel / sheetcols) * plot.height);
+                cout << "Density plot for scale " << scales[si] << " at row " << (sel / sheetcols + 1) << ", column " << (sel % sheetcols + 1) << " of the sheet" << endl;
+                continue;
+            }
+            if (format=="png") write_png(plot, filename.str().c_str());
+            else write_svg_png(plot, filename.str().c_str());
+            cout << "Density plot for scale " << scales[si] << " written in file " << filename.str() << endl;
+            continue;
+        }
     
         static const FloatType sqrt3 = sqrt(3);
         
@@ -326,7 +419,7 @@ int main(int argc, char** argv) {
             densityfile << " " << (x+1 - 0.5*y)*scaleFactor << "," << top-(0.866025403784439 * y)*scaleFactor;
             densityfile << " " << (x+1 - 0.5*(y+1))*scaleFactor << "," << top-(0.866025403784439 * (y+1))*scaleFactor;
             int cellidx = (x*(x+1)/2+ y)*2;
-            string color = scaleColorMap(&density[si * (ncells * nclasses) + cellidx * nclasses],logMinDensity,logMaxDensity,hasUnlabelled);
+            string color = scaleColorString(&density[sel * (ncells * nclasses) + cellidx * nclasses],logMinDensity,logMaxDensity,hasUnlabelled);
             densityfile << "\" style=\"fill:" << color << "; stroke:none;\"/>" << endl;
             if (y<x) { // upper cell
                 densityfile << "<polygon points=\"";
@@ -335,7 +428,7 @@ int main(int argc, char** argv) {
                 densityfile << " " << (x - 0.5*(y+1)
                 )*scaleFactor << "," << top-(0.866025403784439 * (y+1))*scaleFactor;
                 int cellidx = (x*(x+1)/2+ y)*2+1;
-                color = scaleColorMap(&density[si * (ncells * nclasses) + cellidx * nclasses],logMinDensity,logMaxDensity,hasUnlabelled);
+                color = scaleColorString(&density[sel * (ncells * nclasses) + cellidx * nclasses],logMinDensity,logMaxDensity,hasUnlabelled);
                 densityfile << "\" style=\"fill:" << color << "; stroke:none;\"/>" << endl;
             }
         }
@@ -345,6 +438,11 @@ int main(int argc, char** argv) {
         densityfile.close();
         cout << "Density plot for scale " << scales[si] << " written in file " << filename.str() << endl;
     }
+    if (format=="sheet") {
+        string filename = nametag + "_sheet.png";
+        write_png(sheet, filename.c_str());
+        cout << "Density plots written in file " << filename << endl;
+    }
 
     return 0;
 }
@@ -0,0 +1,106 @@
+//**********************************************************************
+//* This file is a part of the CANUPO project, a set of programs for   *
+//* classifying automatically 3D point clouds according to the local   *
+//* multi-scale dimensionality at each point.                          *
+//*                                                                    *
+//* Author & Copyright: Nicolas Brodu <nicolas.brodu@numerimoire.net>  *
+//*                                                                    *
+//* This project is free software; you can redistribute it and/or      *
+//* modify it under the terms of the GNU Lesser General Public         *
+//* License as published by the Free Software Foundation; either       *
+//* version 2.1 of the License, or (at your option) any later version. *
+//*                                                                    *
+//* This library is distributed in the hope that it will be useful,    *
+//* but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+//* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU  *
+//* Lesser General Public License for more details.                    *
+//*                                                                    *
+//* You should have received a copy of the GNU Lesser General Public   *
+//* License along with this library; if not, write to the Free         *
+//* Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,    *
+//* MA  02110-1301  USA                                                *
+//*                                                                    *
+//**********************************************************************/
+
+#ifndef CANUPO_DENSITYRASTER_HPP
+#define CANUPO_DENSITYRASTER_HPP
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#include "points.hpp"
+
+/*
+Number of 2D points within a disk, for many disks: the points are binned once
+in a raster, each point spread bilinearly on the four nearest cell centres so
+the counts vary smoothly with the disk position. A summed-area table then gives
+the weight of any row span in constant time, and a disk is the sum of the spans
+of the cells whose centre it contains.
+*/
+
+struct DensityRaster {
+    FloatType xmin, ymin, cellside;
+    int ncellx, ncelly;
+    // (ncellx+1) * (ncelly+1): weight of the cells below and left of each corner
+    std::vector<double> sat;
+
+    // cells of radius/subdiv, but no more than maxcells along the largest side
+    void prepare(FloatType _xmin, FloatType _xmax, FloatType _ymin, FloatType _ymax, FloatType radius, int subdiv = 8, int maxcells = 2048) {
+        xmin = _xmin; ymin = _ymin;
+        FloatType sizex = std::max(_xmax - _xmin, FloatType(0));
+        FloatType sizey = std::max(_ymax - _ymin, FloatType(0));
+        cellside = std::max(radius / subdiv, std::max(sizex, sizey) / maxcells);
+        ncellx = (int)floor(sizex / cellside) + 1;
+        ncelly = (int)floor(sizey / cellside) + 1;
+        sat.assign((ncellx+1) * (ncelly+1), 0);
+    }
+
+    void insert(FloatType x, FloatType y) {
+        // position in cell centre units, clamped to the raster
+        FloatType cx = std::min(std::max((x - xmin) / cellside - FloatType(0.5), FloatType(0)), FloatType(ncellx-1));
+        FloatType cy = std::min(std::max((y - ymin) / cellside - FloatType(0.5), FloatType(0)), FloatType(ncelly-1));
+        int i = std::min((int)cx, ncellx-2), j = std::min((int)cy, ncelly-2);
+        FloatType fx = cx - i, fy = cy - j;
+        if (ncellx==1) {i = 0; fx = 0;}
+        if (ncelly==1) {j = 0; fy = 0;}
+        cell(i, j) += (1-fx) * (1-fy);
+        if (fx>0) cell(i+1, j) += fx * (1-fy);
+        if (fy>0) cell(i, j+1) += (1-fx) * fy;
+        if (fx>0 && fy>0) cell(i+1, j+1) += fx * fy;
+    }
+
+    // turns the binned weights into the summed-area table, once all points are inserted
+    void finalize() {
+        int w = ncellx+1;
+        for (int j=1; j<=ncelly; ++j) for (int i=1; i<=ncellx; ++i) {
+            sat[j*w+i] += sat[(j-1)*w+i] + sat[j*w+i-1] - sat[(j-1)*w+i-1];
+        }
+    }
+
+    // weight of the cells whose centre is within radius of (x,y)
+    double disk_count(FloatType x, FloatType y, FloatType radius) const {
+        FloatType cx = (x - xmin) / cellside - FloatType(0.5);
+        FloatType cy = (y - ymin) / cellside - FloatType(0.5);
+        FloatType r = radius / cellside;
+        int jmin = std::max((int)ceil(cy - r), 0);
+        int jmax = std::min((int)floor(cy + r), ncelly-1);
+        int w = ncellx+1;
+        double count = 0;
+        for (int j=jmin; j<=jmax; ++j) {
+            FloatType dy = j - cy;
+            FloatType half = sqrt(std::max(r*r - dy*dy, FloatType(0)));
+            int imin = std::max((int)ceil(cx - half), 0);
+            int imax = std::min((int)floor(cx + half), ncellx-1);
+            if (imin>imax) continue;
+            count += sat[(j+1)*w+imax+1] - sat[j*w+imax+1] - sat[(j+1)*w+imin] + sat[j*w+imin];
+        }
+        return count;
+    }
+
+private:
+    // binned weight before finalize, offset by one row and column for the table
+    inline double& cell(int i, int j) {return sat[(j+1)*(ncellx+1)+i+1];}
+};
+
+#endif
@@ -23,13 +23,14 @@
 //**********************************************************************/
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <vector>
+#include <algorithm>
 
 #include <string.h>
 #include <stdlib.h>
 
 #include "points.hpp"
+#include "chunkio.hpp"
 
 using namespace std;
 
@@ -39,59 +40,284 @@ int help(const char* msg = 0, int ret = 0) {
     cout << "Files are text files with one variable per space-separated column" << endl;
     cout << "Constraints are written var_num:min:max" << endl;
     cout << "This says that the variable whose number is given (counting from one) must be in the given range."<< endl;
+    cout << "Constraints may also be expressions on the variables, written c1, c2, etc (counting from one)." << endl;
+    cout << "Expressions use + - * / for arithmetic, < <= > >= == != for comparisons, && || ! for logic, and parentheses." << endl;
+    cout << "Ex: \"c4>0 && (c5<2 || c1*c1+c2*c2 < 100)\". A line is valid if the expression is not 0." << endl;
     cout << "Constraints are combined with AND, a line must respect all constraints to be valid" << endl;
-    cout << "The output file is written with only the valid lines from the input file" << endl;
+    cout << "A line with fewer variables than used by the constraints is not valid" << endl;
+    cout << "The output file is written with only the valid lines from the input file, in the same order" << endl;
     return ret;
 }
 
-struct Constraint {
-    int varnum;
-    double minval, maxval;
+enum OpCode {OP_COL, OP_CONST, OP_NEG, OP_NOT, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR};
+
+// the constraints are compiled in postfix order, and evaluated on batches of lines
+struct Op {
+    OpCode code;
+    int col;        // column number for OP_COL, then its slot in the parsed values
+    double value;   // for OP_CONST
+    Op(OpCode c, int _col = 0, double _value = 0) : code(c), col(_col), value(_value) {}
+};
+
+// recursive descent, by increasing precedence: || && comparisons +- */ unary
+struct ExpressionParser {
+    const char* s;
+    vector<Op>& program;
+    const char* error;
+
+    ExpressionParser(const char* expr, vector<Op>& _program) : s(expr), program(_program), error(0) {}
+
+    bool parse() {
+        parse_or();
+        skip();
+        if (!error && *s!=0) error = "Unexpected characters in constraint";
+        return error==0;
+    }
+
+    void skip() {while (*s==' ' || *s=='\t') ++s;}
+
+    bool accept(const char* token) {
+        skip();
+        size_t n = strlen(token);
+        if (strncmp(s, token, n)) return false;
+        s += n;
+        return true;
+    }
+
+    void parse_or() {
+        parse_and();
+        while (!error && accept("||")) {parse_and(); program.push_back(Op(OP_OR));}
+    }
+
+    void parse_and() {
+        parse_comparison();
+        while (!error && accept("&&")) {parse_comparison(); program.push_back(Op(OP_AND));}
+    }
+
+    void parse_comparison() {
+        parse_sum();
+        while (!error) {
+            OpCode code;
+            if (accept("<=")) code = OP_LE;
+            else if (accept(">=")) code = OP_GE;
+            else if (accept("==")) code = OP_EQ;
+            else if (accept("!=")) code = OP_NE;
+            else if (accept("<")) code = OP_LT;
+            else if (accept(">")) code = OP_GT;
+            else return;
+            parse_sum();
+            program.push_back(Op(code));
+        }
+    }
+
+    void parse_sum() {
+        parse_product();
+        while (!error) {
+            if (accept("+")) {parse_product(); program.push_back(Op(OP_ADD));}
+            else if (accept("-")) {parse_product(); program.push_back(Op(OP_SUB));}
+            else return;
+        }
+    }
+
+    void parse_product() {
+        parse_unary();
+        while (!error) {
+            if (accept("*")) {parse_unary(); program.push_back(Op(OP_MUL));}
+            else if (accept("/")) {parse_unary(); program.push_back(Op(OP_DIV));}
+            else return;
+        }
+    }
+
+    void parse_unary() {
+        if (accept("!")) {parse_unary(); program.push_back(Op(OP_NOT)); return;}
+        if (accept("-")) {parse_unary(); program.push_back(Op(OP_NEG)); return;}
+        if (accept("+")) {parse_unary(); return;}
+        parse_primary();
+    }
+
+    void parse_primary() {
+        if (error) return;
+        if (accept("(")) {
+            parse_or();
+            if (!error && !accept(")")) error = "Missing closing parenthesis in constraint";
+            return;
+        }
+        skip();
+        if (*s=='c' || *s=='C') {
+            char* end;
+            long col = strtol(s+1, &end, 10);
+            if (end==s+1 || col<1) {error = "Invalid variable number"; return;}
+            program.push_back(Op(OP_COL, col-1)); // convert to index
+            s = end;
+            return;
+        }
+        char* end;
+        double value = strtod(s, &end);
+        if (end==s) {error = "Invalid constraint specification"; return;}
+        program.push_back(Op(OP_CONST, 0, value));
+        s = end;
+    }
 };
 
+// advances past the next token exactly as fast_atof_next_token does, without converting it
+inline void skip_next_token(char* &str) {
+    if (*str==0) return;
+    while ((*str==' ')||(*str=='\t')||(*str=='\n')||(*str=='\r')) {
+        ++str; if (*str==0) return;
+    }
+    for (;;++str) {
+        if (*str==0) return;
+        if ((*str>='0' && *str<='9') || *str=='-' || *str=='+') continue;
+        if (*str=='.') {
+            ++str; if (*str==0) return;
+            while ((*str>='0')&&(*str<='9')) {
+                ++str; if (*str==0) return;
+            }
+            if (*str!='e'&&*str!='E') {
+                while ((*str==' ')||(*str=='\t')||(*str=='\n')||(*str=='\r')) ++str;
+                return;
+            }
+        }
+        if (*str=='e' || *str=='E') {
+            for (++str;;++str) {
+                if (*str==0) return;
+                if ((*str>='0' && *str<='9') || *str=='-' || *str=='+') continue;
+                ++str; return;
+            }
+        }
+        ++str; return; // break on invalid characters
+    }
+}
+
+static const int batch_size = 256;
+
+// runs the program on n lines, the result is left in the first register
+void evaluate(const vector<Op>& program, const double* colvalues, double* registers, int n) {
+    int sp = 0;
+    for (size_t opi=0; opi<program.size(); ++opi) {
+        const Op& op = program[opi];
+        double* r = registers + sp * batch_size;
+        double* a = r - batch_size; // top of the stack
+        double* b = r - 2 * batch_size; // below it, left operand of binary ops
+        switch(op.code) {
+            case OP_COL: {
+                const double* c = colvalues + op.col * batch_size;
+                for (int i=0; i<n; ++i) r[i] = c[i];
+                ++sp; break;
+            }
+            case OP_CONST: for (int i=0; i<n; ++i) r[i] = op.value; ++sp; break;
+            case OP_NEG: for (int i=0; i<n; ++i) a[i] = -a[i]; break;
+            case OP_NOT: for (int i=0; i<n; ++i) a[i] = (a[i]==0); break;
+            case OP_ADD: for (int i=0; i<n; ++i) b[i] = b[i] + a[i]; --sp; break;
+            case OP_SUB: for (int i=0; i<n; ++i) b[i] = b[i] - a[i]; --sp; break;
+            case OP_MUL: for (int i=0; i<n; ++i) b[i] = b[i] * a[i]; --sp; break;
+            case OP_DIV: for (int i=0; i<n; ++i) b[i] = b[i] / a[i]; --sp; break;
+            case OP_LT: for (int i=0; i<n; ++i) b[i] = (b[i] < a[i]); --sp; break;
+            case OP_LE: for (int i=0; i<n; ++i) b[i] = (b[i] <= a[i]); --sp; break;
+            case OP_GT: for (int i=0; i<n; ++i) b[i] = (b[i] > a[i]); --sp; break;
+            case OP_GE: for (int i=0; i<n; ++i) b[i] = (b[i] >= a[i]); --sp; break;
+            case OP_EQ: for (int i=0; i<n; ++i) b[i] = (b[i] == a[i]); --sp; break;
+            case OP_NE: for (int i=0; i<n; ++i) b[i] = (b[i] != a[i]); --sp; break;
+            case OP_AND: for (int i=0; i<n; ++i) b[i] = (b[i]!=0 && a[i]!=0); --sp; break;
+            case OP_OR: for (int i=0; i<n; ++i) b[i] = (b[i]!=0 || a[i]!=0); --sp; break;
+        }
+    }
+}
+
 int main(int argc, char** argv) {
 
     if (argc<4) return help();
 
-    vector<Constraint> constraints;
-
-    FILE* input_file = fopen(argv[1], "r");
-    ofstream output_file(argv[2]);
+    vector<Op> program;
 
     for (int argi=3; argi<argc; ++argi) {
         char* col1 = strchr(argv[argi],':');
         char* col2 = strrchr(argv[argi],':');
-        if (col1==0 || col2==0 || col1==col2) {
+        if (col1==0) {
+            ExpressionParser parser(argv[argi], program);
+            if (!parser.parse()) return help(parser.error, 1);
+        } else if (col1==col2) {
             return help("Invalid constraint specification", 1);
         } else {
-            Constraint c;
             *col1++=0;
-            c.varnum = atoi(argv[argi]) - 1; // convert to index
+            int varnum = atoi(argv[argi]) - 1; // convert to index
             *col2++=0;
-            c.minval = atof(col1);
-            c.maxval = atof(col2);
-            if (c.varnum<0) return help("Invalid variable number", 2);
-            if (c.minval>c.maxval) return help("Invalid range", 3);
-            constraints.push_back(c);
+            double minval = atof(col1);
+            double maxval = atof(col2);
+            if (varnum<0) return help("Invalid variable number", 2);
+            if (minval>maxval) return help("Invalid range", 3);
+            // compiled as the expression: value >= minval && value <= maxval
+            program.push_back(Op(OP_COL, varnum));
+            program.push_back(Op(OP_CONST, 0, minval));
+            program.push_back(Op(OP_GE));
+            program.push_back(Op(OP_COL, varnum));
+            program.push_back(Op(OP_CONST, 0, maxval));
+            program.push_back(Op(OP_LE));
+            program.push_back(Op(OP_AND));
         }
+        if (argi>3) program.push_back(Op(OP_AND));
+    }
+
+    // only the used columns are parsed, each in its slot
+    int ncols = 0;
+    for (size_t i=0; i<program.size(); ++i) if (program[i].code==OP_COL) ncols = max(ncols, program[i].col+1);
+    vector<int> colslot(ncols, -1);
+    int nslots = 0;
+    for (size_t i=0; i<program.size(); ++i) if (program[i].code==OP_COL) {
+        if (colslot[program[i].col]==-1) colslot[program[i].col] = nslots++;
+        program[i].col = colslot[program[i].col];
     }
-    
-    int linenum = 0;
-    int nvalues = -1;
-    char* line = 0; size_t linelen = 0; int num_read = 0;
-    while ((num_read = getline(&line, &linelen, input_file)) != -1) {
-        ++linenum;
-        if (linelen==0 || line[0]=='#') continue;
-        vector<double> values;
-        for (char* x = line; *x!=0;) values.push_back(fast_atof_next_token(x));
-        bool ok = true;
-        for (unsigned int i=0; i<constraints.size(); ++i) {
-            if (constraints[i].varnum>=values.size()) {ok = false; break;}
-            if (values[constraints[i].varnum] < constraints[i].minval) {ok = false; break;}
-            if (values[constraints[i].varnum] > constraints[i].maxval) {ok = false; break;}
+    int stackdepth = 0, maxstackdepth = 0;
+    for (size_t i=0; i<program.size(); ++i) {
+        if (program[i].code==OP_COL || program[i].code==OP_CONST) maxstackdepth = max(maxstackdepth, ++stackdepth);
+        else if (program[i].code>=OP_ADD) --stackdepth;
+    }
+
+    MappedTextFile input(argv[1]);
+    ofstream output_file(argv[2], ofstream::binary);
+
+    // the chunks are filtered in parallel and written in order
+    vector<size_t> chunkbegin;
+    input.split(1<<22, chunkbegin);
+    int nchunks = chunkbegin.size() - 1;
+
+#pragma omp parallel
+{
+    vector<char> line;
+    vector<double> colvalues(max(1,nslots) * batch_size);
+    vector<double> registers(max(1,maxstackdepth) * batch_size);
+    vector<size_t> batchoffsets(batch_size);
+    vector<bool> complete(batch_size);
+    vector<size_t> kept;
+#pragma omp for ordered schedule(dynamic,1)
+    for (int c=0; c<nchunks; ++c) {
+        kept.clear();
+        for (size_t offset = chunkbegin[c]; offset < chunkbegin[c+1];) {
+            // parse a batch of lines
+            int n = 0;
+            while (n < batch_size && offset < chunkbegin[c+1]) {
+                size_t end = input.line_end(offset);
+                if (input.data[offset]=='#') {offset = end; continue;}
+                // fast_atof_next_token needs a 0-terminated line
+                line.assign(input.data + offset, input.data + end);
+                line.push_back(0);
+                char* x = &line[0];
+                int col = 0;
+                for (; col<ncols && *x!=0; ++col) {
+                    if (colslot[col]==-1) skip_next_token(x);
+                    else colvalues[colslot[col] * batch_size + n] = fast_atof_next_token(x);
+                }
+                complete[n] = (col==ncols);
+                batchoffsets[n++] = offset;
+                offset = end;
+            }
+            evaluate(program, &colvalues[0], &registers[0], n);
+            for (int i=0; i<n; ++i) if (complete[i] && registers[i]!=0) kept.push_back(batchoffsets[i]);
         }
-        if (ok) output_file << line;
+#pragma omp ordered
+        write_lines(output_file, input, kept);
     }
-    
+}
+
     return 0;
 }
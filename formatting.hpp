@@ -0,0 +1,199 @@
+//**********************************************************************
+//* This file is a part of the CANUPO project, a set of programs for   *
+//* classifying automatically 3D point clouds according to the local   *
+//* multi-scale dimensionality at each point.                          *
+//*                                                                    *
+//* Author & Copyright: Nicolas Brodu <nicolas.brodu@numerimoire.net>  *
+//*                                                                    *
+//* This project is free software; you can redistribute it and/or      *
+//* modify it under the terms of the GNU Lesser General Public         *
+//* License as published by the Free Software Foundation; either       *
+//* version 2.1 of the License, or (at your option) any later version. *
+//*                                                                    *
+//* This library is distributed in the hope that it will be useful,    *
+//* but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+//* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU  *
+//* Lesser General Public License for more details.                    *
+//*                                                                    *
+//* You should have received a copy of the GNU Lesser General Public   *
+//* License along with this library; if not, write to the Free         *
+//* Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,    *
+//* MA  02110-1301  USA                                                *
+//*                                                                    *
+//**********************************************************************/
+#ifndef CANUPO_FORMATTING_HPP
+#define CANUPO_FORMATTING_HPP
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <string.h>
+
+/*
+Fast number to text conversion for the large xyz outputs.
+
+Each function writes at the given position, without a terminating 0, and returns the
+position just after the last written character. The caller is responsible for
+having enough space: format_max_chars per number are always sufficient.
+
+Floats are written with 9 significant digits, which is enough to read back exactly the
+same float. The output is the same as printf's %.9g, at most 15 characters.
+Doubles are delegated to snprintf with 17 significant digits, for the same guarantee.
+These take up to 24 characters (ex: -1.2345678901234567e-150), and snprintf also
+writes its terminating 0 after them.
+The format_real_shortest variants write the fewest digits that still read back exactly.
+*/
+
+static const int format_max_chars = 32;
+
+inline char* format_uint(char* p, unsigned long long v) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+inline char* format_int(char* p, long long v) {
+    if (v<0) {
+        *p++ = '-';
+        return format_uint(p, 0ULL - (unsigned long long)v);
+    }
+    return format_uint(p, v);
+}
+
+inline double power_of_ten(int n) {
+    static const double table[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26, 1e27, 1e28, 1e29, 1e30, 1e31,
+        1e32, 1e33, 1e34, 1e35, 1e36, 1e37, 1e38, 1e39, 1e40, 1e41, 1e42, 1e43, 1e44, 1e45, 1e46, 1e47,
+        1e48, 1e49, 1e50, 1e51, 1e52, 1e53, 1e54, 1e55, 1e56, 1e57, 1e58, 1e59, 1e60, 1e61, 1e62, 1e63
+    };
+    if (n<64) return table[n];
+    return pow(10.0, n);
+}
+
+inline char* format_real(char* p, double v) {
+    return p + snprintf(p, format_max_chars, "%.17g", v);
+}
+
+// float with the given number of significant digits, from 1 to 9, like printf's %.<ndigits>g
+inline char* format_real_digits(char* p, float fv, int ndigits) {
+    const unsigned long long lowest = (unsigned long long)power_of_ten(ndigits-1), highest = lowest * 10;
+    if (fv!=fv) {
+        *p++ = 'n'; *p++ = 'a'; *p++ = 'n';
+        return p;
+    }
+    // all float are exactly representable as double and 9 digits fit the mantissa
+    double v = fv;
+    if (v<0 || (v==0 && signbit(v))) {
+        *p++ = '-';
+        v = -v;
+    }
+    if (v==0) {
+        *p++ = '0';
+        return p;
+    }
+    if (isinf(v)) {
+        *p++ = 'i'; *p++ = 'n'; *p++ = 'f';
+        return p;
+    }
+    // decimal exponent and the significant digits as an integer
+    int binexp;
+    frexp(v, &binexp);
+    int exponent = (binexp * 1233) >> 12; // log10(2) ~ 1233/4096, may be off by one
+    unsigned long long digits = 0;
+    for (int attempt=0; attempt<3; ++attempt) {
+        int shift = ndigits - 1 - exponent;
+        // the double rounding error is far below the resolution of 9 digits
+        double scaled = shift>=0 ? v * power_of_ten(shift) : v / power_of_ten(-shift);
+        double fl = floor(scaled);
+        // the estimated exponent may be off by one
+        if (fl>=highest) {++exponent; continue;}
+        if (fl<lowest) {--exponent; continue;}
+        digits = (unsigned long long)fl;
+        // round half to even, like printf
+        double frac = scaled - fl;
+        if (frac>0.5 || (frac==0.5 && (digits&1))) ++digits;
+        // rounding may carry over
+        if (digits>=highest) {digits /= 10; ++exponent;}
+        break;
+    }
+    // %g removes the trailing zeros
+    int nd = ndigits;
+    while (nd>1 && digits%10==0) {
+        digits /= 10;
+        --nd;
+    }
+    char d[9] = {0};
+    for (int i=nd-1; i>=0; --i) {
+        d[i] = '0' + (digits % 10);
+        digits /= 10;
+    }
+    if (exponent < -4 || exponent >= ndigits) {
+        *p++ = d[0];
+        if (nd>1) {
+            *p++ = '.';
+            for (int i=1; i<nd; ++i) *p++ = d[i];
+        }
+        *p++ = 'e';
+        if (exponent<0) {*p++ = '-'; exponent = -exponent;}
+        else *p++ = '+';
+        if (exponent<10) *p++ = '0';
+        return format_uint(p, exponent);
+    }
+    if (exponent<0) {
+        *p++ = '0'; *p++ = '.';
+        for (int i=-1; i>exponent; --i) *p++ = '0';
+        for (int i=0; i<nd; ++i) *p++ = d[i];
+        return p;
+    }
+    for (int i=0; i<=exponent; ++i) *p++ = i<nd ? d[i] : '0';
+    if (nd > exponent+1) {
+        *p++ = '.';
+        for (int i=exponent+1; i<nd; ++i) *p++ = d[i];
+    }
+    return p;
+}
+
+inline char* format_real(char* p, float fv) {
+    return format_real_digits(p, fv, 9);
+}
+
+// shortest text that reads back as the same float
+// For normal floats, the 6 digits version is the shortest when 6 digits or less are enough, as the
+// trailing zeros are removed. Otherwise 7 and 8 digits are tried before the full 9.
+// Subnormals have less precision, so fewer digits may do: these are tried from 1
+inline char* format_real_shortest(char* p, float fv) {
+    if (fv!=fv || isinf(fv)) return format_real(p, fv);
+    char tmp[format_max_chars];
+    for (int ndigits = fabsf(fv) < FLT_MIN ? 1 : 6; ndigits < 9; ++ndigits) {
+        char* end = format_real_digits(tmp, fv, ndigits);
+        *end = 0;
+        if (strtof(tmp, 0)==fv) {
+            for (char* t = tmp; t<end;) *p++ = *t++;
+            return p;
+        }
+    }
+    return format_real_digits(p, fv, 9);
+}
+
+inline char* format_real_shortest(char* p, double v) {
+    if (v!=v || isinf(v)) return format_real(p, v);
+    // same as above, with 15 digits for normal doubles
+    char tmp[format_max_chars];
+    for (int ndigits = fabs(v) < DBL_MIN ? 1 : 15; ndigits < 17; ++ndigits) {
+        int n = snprintf(tmp, format_max_chars, "%.*g", ndigits, v);
+        if (n>0 && n<format_max_chars && strtod(tmp, 0)==v) {
+            memcpy(p, tmp, n);
+            return p + n;
+        }
+    }
+    return format_real(p, v);
+}
+
+#endif
@@ -29,8 +29,13 @@
 #define CANUPO_HELPERS_HPP
 
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <deque>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -53,9 +58,105 @@ bool fpeq(FloatType a, FloatType b) {
     return ratio>1-epsilon && ratio<1+epsilon;
 }
 
+/*
+MSC file formats
+
+Version 1 is the original one, written by canupo: a header, then one record per core point
+  int npts, int nscales, FloatType scales[nscales], int ptnparams
+  records: FloatType params[ptnparams] (x,y,z then others), FloatType (a,b)[nscales], int nneighbors[nscales]
+
+Version 2 is column-major by blocks of points, so the wanted scales can be read without the others
+  int -1 (versioned file marker, where v1 has npts>0), int version = 2, int sizeof(FloatType)
+  int npts, int nscales, FloatType scales[nscales], int ptnparams
+  int abencoding (MSC_AB_FLOAT, MSC_AB_HALF or MSC_AB_UINT16), int blocksize, int nblocks
+  int64_t blockoffsets[nblocks]: file offset of each block
+  blocks of n=blocksize points (fewer in the last one), each column padded to 8 bytes:
+    FloatType params[ptnparams][n], a[nscales][n], b[nscales][n] (encoded), int nneighbors[nscales][n]
+
+read_msc_header reads both versions. read_msc_columns then gives views on the columns
+of the wanted scales only, directly in the mapped file except for the 16-bit encodings.
+read_msc_records gives the points in the version 1 record layout, for whole-record copies.
+*/
+
+enum {MSC_AB_FLOAT = 0, MSC_AB_HALF = 1, MSC_AB_UINT16 = 2};
+
+// IEEE 754 half precision, rounding to nearest even
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t absx = x & 0x7FFFFFFF;
+    if (absx >= 0x7F800000) return sign | 0x7C00 | (absx > 0x7F800000 ? 0x200 : 0); // inf or nan
+    if (absx >= 0x477FF000) return sign | 0x7C00; // rounds above the largest half
+    if (absx < 0x33000001) return sign; // rounds to 0
+    int exponent = (absx >> 23) - 127 + 15;
+    uint32_t mantissa = (absx & 0x7FFFFF) | 0x800000;
+    int shift = exponent > 0 ? 13 : 14 - exponent; // subnormal halves lose more bits
+    uint32_t h = (exponent > 0 ? ((uint32_t)exponent << 10) : 0) + ((mantissa >> shift) & (exponent > 0 ? 0x3FF : 0x7FF));
+    uint32_t rest = mantissa & ((1u << shift) - 1), half = 1u << (shift - 1);
+    if (rest > half || (rest == half && (h & 1))) ++h; // may carry into the exponent, as it should
+    return sign | h;
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    int exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t x;
+    if (exponent == 0x1F) x = sign | 0x7F800000 | (mantissa << 13);
+    else if (exponent != 0) x = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+    else if (mantissa == 0) x = sign;
+    else {
+        // subnormal half, normal float
+        exponent = 1;
+        while (!(mantissa & 0x400)) {mantissa <<= 1; --exponent;}
+        x = sign | ((uint32_t)(exponent - 15 + 127) << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float f;
+    memcpy(&f, &x, 4);
+    return f;
+}
+
+// the a,b proportions are within [0,1]
+inline uint16_t ab_to_uint16(FloatType v) {
+    if (!(v > 0)) return 0;
+    if (v >= 1) return 65535;
+    return (uint16_t)(v * 65535 + 0.5f);
+}
+
+inline FloatType uint16_to_ab(uint16_t q) {
+    return q / FloatType(65535);
+}
+
+inline int msc_ab_size(int abencoding) {
+    return abencoding==MSC_AB_FLOAT ? sizeof(FloatType) : sizeof(uint16_t);
+}
+
+// column sizes are padded so all columns are aligned
+inline size_t msc_column_size(int npts, int elemsize) {
+    return ((size_t)npts * elemsize + 7) & ~(size_t)7;
+}
+
+// what read_msc_header found, used by read_msc_columns and read_msc_records
+struct MSCLayout {
+    int version;
+    int npts, nscales, ptnparams;
+    std::vector<int> allscales;
+    // version 1 only: file offset of the first record
+    int64_t dataoffset;
+    // version 2 only
+    int abencoding, blocksize;
+    std::vector<int64_t> blockoffsets;
+    int nextpoint;
+    std::vector<char> records;
+    std::vector<FloatType> decoded;
+    MSCLayout() : version(1), npts(0), nscales(0), ptnparams(0), dataoffset(0), abencoding(MSC_AB_FLOAT), blocksize(0), nextpoint(0) {}
+};
+
 #ifdef NO_MMAP
-struct MSCFile {
+struct MSCFile : public MSCLayout {
     std::ifstream realfile;
+    std::vector<char> buffer;
     MSCFile(const char* name) {
         realfile.open(name, std::ifstream::binary);
     }
@@ -63,9 +164,35 @@ struct MSCFile {
     template<typename T> void read(T& value) {
         realfile.read((char*)&value, sizeof(T));
     }
+    // the next nbytes of the file, valid until the next call
+    const char* data_block(size_t nbytes) {
+        buffer.resize(nbytes);
+        realfile.read(&buffer[0], nbytes);
+        if ((size_t)realfile.gcount()!=nbytes) {
+            std::cerr << "invalid msc file (truncated data)" << std::endl;
+            exit(1);
+        }
+        return &buffer[0];
+    }
+    // nbytes at the given position in the file, valid until the next call
+    const char* data_at(int64_t position, size_t nbytes) {
+        realfile.clear();
+        realfile.seekg(position);
+        return data_block(nbytes);
+    }
+    // same, but valid until release_columns, so several columns can be used together
+    std::deque<std::vector<char> > columns;
+    const char* column_at(int64_t position, size_t nbytes) {
+        data_at(position, nbytes);
+        columns.push_back(std::vector<char>());
+        columns.back().swap(buffer);
+        return &columns.back()[0];
+    }
+    void release_columns() {columns.clear();}
+    int64_t position() {return realfile.tellg();}
 };
 #else
-struct MSCFile {
+struct MSCFile : public MSCLayout {
     int fd;
     char* memzone;
     off_t zone_size;
@@ -90,6 +217,25 @@ struct MSCFile {
         value = *reinterpret_cast<T*>(&memzone[offset]);
         offset += sizeof(T);
     }
+    // the next nbytes of the file, valid until the next call
+    const char* data_block(size_t nbytes) {
+        if (offset + (off_t)nbytes > zone_size) {
+            std::cerr << "invalid msc file (truncated data)" << std::endl;
+            exit(1);
+        }
+        const char* ret = memzone + offset;
+        offset += nbytes;
+        return ret;
+    }
+    // nbytes at the given position in the file, valid until the next call
+    const char* data_at(int64_t position, size_t nbytes) {
+        offset = position;
+        return data_block(nbytes);
+    }
+    // the file is mapped whole, so the columns stay valid anyway
+    const char* column_at(int64_t position, size_t nbytes) {return data_at(position, nbytes);}
+    void release_columns() {}
+    int64_t position() {return offset;}
 };
 #endif
 
@@ -100,6 +246,21 @@ int read_msc_header(MSCFile& mscfile, std::vector<FloatType>& scales, int& ptnpa
     using namespace std;
     int npts;
     mscfile.read(npts);
+    mscfile.version = 1;
+    if (npts==-1) {
+        mscfile.read(mscfile.version);
+        if (mscfile.version!=2) {
+            cerr << "unsupported msc file version " << mscfile.version << endl;
+            exit(1);
+        }
+        int floatsize;
+        mscfile.read(floatsize);
+        if (floatsize!=sizeof(FloatType)) {
+            cerr << "this msc file was written with " << (floatsize==4?"float":"double") << " values, this program uses " << (sizeof(FloatType)==4?"float":"double") << endl;
+            exit(1);
+        }
+        mscfile.read(npts);
+    }
     if (npts<=0) {
         cerr << "invalid msc file (negative or null number of points)" << endl;
         exit(1);
@@ -133,31 +294,300 @@ int read_msc_header(MSCFile& mscfile, std::vector<FloatType>& scales, int& ptnpa
     
     mscfile.read(ptnparams);
 
+    mscfile.npts = npts;
+    mscfile.nscales = nscales_thisfile;
+    mscfile.ptnparams = ptnparams;
+    mscfile.nextpoint = 0;
+    mscfile.allscales.resize(nscales_thisfile);
+    for (int si=0; si<nscales_thisfile; ++si) mscfile.allscales[si] = si;
+    if (mscfile.version==1) mscfile.dataoffset = mscfile.position();
+    if (mscfile.version==2) {
+        int nblocks;
+        mscfile.read(mscfile.abencoding);
+        mscfile.read(mscfile.blocksize);
+        mscfile.read(nblocks);
+        if (mscfile.abencoding<MSC_AB_FLOAT || mscfile.abencoding>MSC_AB_UINT16 || mscfile.blocksize<=0 || nblocks != (npts + mscfile.blocksize - 1) / mscfile.blocksize) {
+            cerr << "invalid msc file (bad block layout)" << endl;
+            exit(1);
+        }
+        mscfile.blockoffsets.resize(nblocks);
+        for (int i=0; i<nblocks; ++i) mscfile.read(mscfile.blockoffsets[i]);
+    }
+
     return npts;
 }
 
-void read_msc_data(MSCFile& mscfile, int nscales, int npts, FloatType* data, int ptnparams, bool convert_from_tri_to_2D = false) {
-    for (int pt=0; pt<npts; ++pt) {
-        FloatType param;
-        // we do not care for the point coordinates and other parameters
+// same layout as read by read_msc_header
+void write_msc_header(std::ostream& mscfile, int npts, const std::vector<FloatType>& scales, int ptnparams) {
+    mscfile.write((char*)&npts, sizeof(npts));
+    int nscales = scales.size();
+    mscfile.write((char*)&nscales, sizeof(nscales));
+    for (int si=0; si<nscales; ++si) mscfile.write((char*)&scales[si], sizeof(FloatType));
+    mscfile.write((char*)&ptnparams, sizeof(int));
+}
+
+// size in bytes of each point record following the header
+inline size_t msc_record_size(int nscales, int ptnparams) {
+    return (ptnparams + nscales*2) * sizeof(FloatType) + nscales * sizeof(int);
+}
+
+// Typed access to values every stride bytes, without alignment requirements
+template<typename T> struct StridedView {
+    const char* data;
+    size_t stride;
+    StridedView(const char* _data, size_t _stride) : data(_data), stride(_stride) {}
+    inline T operator[](int i) const {
+        T value;
+        memcpy(&value, data + i * stride, sizeof(T));
+        return value;
+    }
+};
+
+// Views on a range of points, as returned by read_msc_columns: the point parameters,
+// then the a, b and number of neighbors at each of the scales that were read
+struct MSCRecords {
+    int npts, nscales, ptnparams;
+    std::vector<StridedView<FloatType> > params, avalues, bvalues;
+    std::vector<StridedView<int> > nneighs;
+    MSCRecords() : npts(0), nscales(0), ptnparams(0) {}
+    const StridedView<FloatType>& param(int i) const {return params[i];}
+    const StridedView<FloatType>& a(int s) const {return avalues[s];}
+    const StridedView<FloatType>& b(int s) const {return bvalues[s];}
+    const StridedView<int>& nneigh(int s) const {return nneighs[s];}
+};
+
+// views on npts records in the version 1 layout, for the given scale indices
+inline MSCRecords msc_record_views(const char* data, int npts, int nscales, int ptnparams, const std::vector<int>& scaleindices) {
+    size_t recsize = msc_record_size(nscales, ptnparams);
+    MSCRecords records;
+    records.npts = npts;
+    records.nscales = scaleindices.size();
+    records.ptnparams = ptnparams;
+    for (int i=0; i<ptnparams; ++i) records.params.push_back(StridedView<FloatType>(data + i * sizeof(FloatType), recsize));
+    for (int k=0; k<records.nscales; ++k) {
+        int s = scaleindices[k];
+        records.avalues.push_back(StridedView<FloatType>(data + (ptnparams + s*2) * sizeof(FloatType), recsize));
+        records.bvalues.push_back(StridedView<FloatType>(data + (ptnparams + s*2 + 1) * sizeof(FloatType), recsize));
+        records.nneighs.push_back(StridedView<int>(data + (ptnparams + nscales*2) * sizeof(FloatType) + s * sizeof(int), recsize));
+    }
+    return records;
+}
+
+// Views on the points first to first+n-1, for the given scale indices only. A version 2
+// file gives fewer points when its block ends before: check npts in the result.
+// With mmap the views point directly into the file, except for the 16-bit a,b encodings
+// which are decoded for the read scales only. The views are valid until the next call
+MSCRecords read_msc_columns(MSCFile& mscfile, int first, int n, const std::vector<int>& scaleindices) {
+    if (first<0 || n<=0 || first + n > mscfile.npts) {
+        std::cerr << "invalid msc file (reading past the last point)" << std::endl;
+        exit(1);
+    }
+    int nscales = mscfile.nscales, ptnparams = mscfile.ptnparams;
+    mscfile.release_columns();
+    if (mscfile.version==1) {
+        size_t recsize = msc_record_size(nscales, ptnparams);
+        const char* data = mscfile.column_at(mscfile.dataoffset + (int64_t)first * recsize, n * recsize);
+        return msc_record_views(data, n, nscales, ptnparams, scaleindices);
+    }
+    int block = first / mscfile.blocksize;
+    int start = first % mscfile.blocksize;
+    int blockpts = std::min(mscfile.blocksize, mscfile.npts - block * mscfile.blocksize);
+    n = std::min(n, blockpts - start);
+    int nsel = scaleindices.size();
+    int absize = msc_ab_size(mscfile.abencoding);
+    MSCRecords records;
+    records.npts = n;
+    records.nscales = nsel;
+    records.ptnparams = ptnparams;
+    int64_t paramcolumns = mscfile.blockoffsets[block];
+    int64_t abcolumns = paramcolumns + ptnparams * msc_column_size(blockpts, sizeof(FloatType));
+    int64_t nncolumns = abcolumns + 2 * nscales * msc_column_size(blockpts, absize);
+    for (int i=0; i<ptnparams; ++i) {
+        const char* column = mscfile.column_at(paramcolumns + i * msc_column_size(blockpts, sizeof(FloatType)) + start * sizeof(FloatType), n * sizeof(FloatType));
+        records.params.push_back(StridedView<FloatType>(column, sizeof(FloatType)));
+    }
+    if (mscfile.abencoding!=MSC_AB_FLOAT) mscfile.decoded.resize(2 * nsel * n);
+    for (int ab=0; ab<2; ++ab) for (int k=0; k<nsel; ++k) {
+        const char* column = mscfile.column_at(abcolumns + (ab * nscales + scaleindices[k]) * msc_column_size(blockpts, absize) + start * absize, n * absize);
+        if (mscfile.abencoding!=MSC_AB_FLOAT) {
+            FloatType* dest = &mscfile.decoded[(ab * nsel + k) * n];
+            for (int i=0; i<n; ++i) {
+                uint16_t q;
+                memcpy(&q, column + i * sizeof(uint16_t), sizeof(uint16_t));
+                dest[i] = mscfile.abencoding==MSC_AB_HALF ? half_to_float(q) : uint16_to_ab(q);
+            }
+            column = (const char*)dest;
+        }
+        (ab==0 ? records.avalues : records.bvalues).push_back(StridedView<FloatType>(column, sizeof(FloatType)));
+    }
+    for (int k=0; k<nsel; ++k) {
+        const char* column = mscfile.column_at(nncolumns + scaleindices[k] * msc_column_size(blockpts, sizeof(int)) + start * sizeof(int), n * sizeof(int));
+        records.nneighs.push_back(StridedView<int>(column, sizeof(int)));
+    }
+    return records;
+}
+
+// the viewed points in the version 1 record layout, with the scales that were read
+void gather_msc_records(const MSCRecords& records, char* out) {
+    size_t recsize = msc_record_size(records.nscales, records.ptnparams);
+    // column by column, each is read sequentially
+    for (int i=0; i<records.ptnparams; ++i) for (int pt=0; pt<records.npts; ++pt) {
+        FloatType v = records.param(i)[pt];
+        memcpy(out + pt * recsize + i * sizeof(FloatType), &v, sizeof(FloatType));
+    }
+    for (int s=0; s<records.nscales; ++s) for (int pt=0; pt<records.npts; ++pt) {
+        FloatType ab[2] = {records.a(s)[pt], records.b(s)[pt]};
+        memcpy(out + pt * recsize + (records.ptnparams + s*2) * sizeof(FloatType), ab, sizeof(ab));
+    }
+    for (int s=0; s<records.nscales; ++s) for (int pt=0; pt<records.npts; ++pt) {
+        int nn = records.nneigh(s)[pt];
+        memcpy(out + pt * recsize + (records.ptnparams + records.nscales*2) * sizeof(FloatType) + s * sizeof(int), &nn, sizeof(int));
+    }
+}
+
+// The next nrecords points, in the version 1 record layout of msc_record_size bytes each,
+// whatever the file version. The data is valid until the next call
+const char* read_msc_records(MSCFile& mscfile, int nrecords) {
+    size_t recsize = msc_record_size(mscfile.nscales, mscfile.ptnparams);
+    if (mscfile.nextpoint + nrecords > mscfile.npts) {
+        std::cerr << "invalid msc file (reading past the last point)" << std::endl;
+        exit(1);
+    }
+    if (mscfile.version==1) {
+        const char* data = mscfile.data_at(mscfile.dataoffset + (int64_t)mscfile.nextpoint * recsize, nrecords * recsize);
+        mscfile.nextpoint += nrecords;
+        return data;
+    }
+    mscfile.records.resize(nrecords * recsize);
+    for (int done = 0; done < nrecords;) {
+        MSCRecords columns = read_msc_columns(mscfile, mscfile.nextpoint + done, nrecords - done, mscfile.allscales);
+        gather_msc_records(columns, &mscfile.records[done * recsize]);
+        done += columns.npts;
+    }
+    mscfile.nextpoint += nrecords;
+    return &mscfile.records[0];
+}
+
+// Writes a version 2 file, from version 1 records obtained with next_records(nrecords)
+template<class NextRecords>
+void write_msc_v2(std::ostream& outfile, int npts, const std::vector<FloatType>& scales, int ptnparams, int abencoding, NextRecords next_records, int blocksize = 65536) {
+    int nscales = scales.size();
+    int marker = -1, version = 2, floatsize = sizeof(FloatType);
+    outfile.write((char*)&marker, sizeof(int));
+    outfile.write((char*)&version, sizeof(int));
+    outfile.write((char*)&floatsize, sizeof(int));
+    write_msc_header(outfile, npts, scales, ptnparams);
+    int nblocks = (npts + blocksize - 1) / blocksize;
+    outfile.write((char*)&abencoding, sizeof(int));
+    outfile.write((char*)&blocksize, sizeof(int));
+    outfile.write((char*)&nblocks, sizeof(int));
+    // the block sizes are known in advance
+    int absize = msc_ab_size(abencoding);
+    int64_t offset = 9 * sizeof(int) + nscales * sizeof(FloatType) + nblocks * sizeof(int64_t);
+    for (int block=0; block<nblocks; ++block) {
+        int blockpts = std::min(blocksize, npts - block * blocksize);
+        outfile.write((char*)&offset, sizeof(int64_t));
+        offset += ptnparams * msc_column_size(blockpts, sizeof(FloatType)) + 2 * nscales * msc_column_size(blockpts, absize) + nscales * msc_column_size(blockpts, sizeof(int));
+    }
+    size_t recsize = msc_record_size(nscales, ptnparams);
+    std::vector<char> column(msc_column_size(blocksize, sizeof(FloatType)) + msc_column_size(blocksize, sizeof(int)));
+    for (int block=0; block<nblocks; ++block) {
+        int blockpts = std::min(blocksize, npts - block * blocksize);
+        const char* records = next_records(blockpts);
+        // gathers a column from the records, each at the given position
         for (int i=0; i<ptnparams; ++i) {
-            mscfile.read(param);
+            for (int pt=0; pt<blockpts; ++pt) memcpy(&column[pt * sizeof(FloatType)], records + pt * recsize + i * sizeof(FloatType), sizeof(FloatType));
+            memset(&column[blockpts * sizeof(FloatType)], 0, msc_column_size(blockpts, sizeof(FloatType)) - blockpts * sizeof(FloatType));
+            outfile.write(&column[0], msc_column_size(blockpts, sizeof(FloatType)));
         }
-        for (int s=0; s<nscales; ++s) {
-            mscfile.read(data[s*2]);
-            mscfile.read(data[s*2+1]);
-            if (convert_from_tri_to_2D) {
-                FloatType c = 1 - data[s*2] - data[s*2+1];
-                FloatType x = data[s*2+1] + c / 2;
-                FloatType y = c * sqrt(3)/2;
-                data[s*2] = x;
-                data[s*2+1] = y;
+        for (int ab=0; ab<2; ++ab) for (int s=0; s<nscales; ++s) {
+            for (int pt=0; pt<blockpts; ++pt) {
+                FloatType v;
+                memcpy(&v, records + pt * recsize + (ptnparams + s*2 + ab) * sizeof(FloatType), sizeof(FloatType));
+                if (abencoding==MSC_AB_FLOAT) memcpy(&column[pt * absize], &v, absize);
+                else {
+                    uint16_t q = abencoding==MSC_AB_HALF ? float_to_half(v) : ab_to_uint16(v);
+                    memcpy(&column[pt * absize], &q, absize);
+                }
             }
+            memset(&column[blockpts * absize], 0, msc_column_size(blockpts, absize) - blockpts * absize);
+            outfile.write(&column[0], msc_column_size(blockpts, absize));
         }
-        // we do not care for number of neighbors and average dist between nearest neighbors
-        int fooi;
-        for (int i=0; i<nscales; ++i) mscfile.read(fooi);
-        data += nscales*2;
+        for (int s=0; s<nscales; ++s) {
+            for (int pt=0; pt<blockpts; ++pt) memcpy(&column[pt * sizeof(int)], records + pt * recsize + (ptnparams + nscales*2) * sizeof(FloatType) + s * sizeof(int), sizeof(int));
+            memset(&column[blockpts * sizeof(int)], 0, msc_column_size(blockpts, sizeof(int)) - blockpts * sizeof(int));
+            outfile.write(&column[0], msc_column_size(blockpts, sizeof(int)));
+        }
+    }
+}
+
+// Views on the next points of the file at all scales, at most nrecords: see read_msc_columns
+inline MSCRecords read_msc_view(MSCFile& mscfile, int nrecords) {
+    MSCRecords records = read_msc_columns(mscfile, mscfile.nextpoint, nrecords, mscfile.allscales);
+    mscfile.nextpoint += records.npts;
+    return records;
+}
+
+// project in the equilateral triangle a*(0,0) + b*(1,0) + c*(1/2,sqrt3/2)
+// equivalently to the triangle formed by the three components unit vector
+// so each a,b,c = dimensionality of the data is given equal weight
+inline void tri_to_2D(FloatType a, FloatType b, FloatType& x, FloatType& y) {
+    FloatType c = 1 - a - b;
+    x = b + c / 2;
+    y = c * sqrt(3)/2;
+}
+
+// dlib column vectors and std::vector samples
+template<class Sample> inline void set_feature(Sample& sample, int i, FloatType value) {sample(i) = value;}
+inline void set_feature(std::vector<FloatType>& sample, int i, FloatType value) {sample[i] = value;}
+
+// The (a,b) values at all scales of each record, in parallel
+template<class Sample>
+void decode_msc_features(const MSCRecords& records, Sample* samples, bool convert_from_tri_to_2D) {
+#pragma omp parallel for schedule(static)
+    for (int pt=0; pt<records.npts; ++pt) {
+        for (int s=0; s<records.nscales; ++s) {
+            FloatType a = records.a(s)[pt], b = records.b(s)[pt];
+            if (convert_from_tri_to_2D) tri_to_2D(a, b, a, b);
+            set_feature(samples[pt], s*2, a);
+            set_feature(samples[pt], s*2+1, b);
+        }
+    }
+}
+
+// Same for a flat array of nscales*2 values per record
+void decode_msc_features(const MSCRecords& records, FloatType* data, bool convert_from_tri_to_2D) {
+    int nscales = records.nscales;
+#pragma omp parallel for schedule(static)
+    for (int pt=0; pt<records.npts; ++pt) {
+        FloatType* ptdata = data + (size_t)pt * nscales * 2;
+        // we do not care for the point coordinates and other parameters
+        // nor for number of neighbors and average dist between nearest neighbors
+        for (int s=0; s<nscales; ++s) {
+            ptdata[s*2] = records.a(s)[pt];
+            ptdata[s*2+1] = records.b(s)[pt];
+            if (convert_from_tri_to_2D) tri_to_2D(ptdata[s*2], ptdata[s*2+1], ptdata[s*2], ptdata[s*2+1]);
+        }
+    }
+}
+
+static const int msc_block_records = 65536;
+
+void read_msc_data(MSCFile& mscfile, int nscales, int npts, FloatType* data, int ptnparams, bool convert_from_tri_to_2D = false) {
+    for (int pt=0; pt<npts;) {
+        MSCRecords records = read_msc_view(mscfile, std::min(msc_block_records, npts - pt));
+        decode_msc_features(records, data + (size_t)pt * nscales * 2, convert_from_tri_to_2D);
+        pt += records.npts;
+    }
+}
+
+// Classifier samples of nscales*2 features each, the (a,b) values projected in the triangle
+template<class Sample>
+void read_msc_samples(MSCFile& mscfile, int npts, Sample* samples) {
+    for (int pt=0; pt<npts;) {
+        MSCRecords records = read_msc_view(mscfile, std::min(msc_block_records, npts - pt));
+        decode_msc_features(records, samples + pt, true);
+        pt += records.npts;
     }
 }
 
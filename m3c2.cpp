@@ -152,8 +152,9 @@ m3c2 normal_scale(s) : [cylinder_base : [cylinder_length : ]] p1.xyz[:p1reduced.
                          #  k: Value for the ksi parameter (default is 0) for selecting the scale at which the normal is computed. The smallest scale satisfying ksi > this_value will be used. See the paper for what ksi means. Use a value of 0 to disable this parameter. In that case, the scale at which the cloud looks most 2D is used instead. Note: The value of ksi computed at the normal selection stage may differ from the final value given by the ksi1/2 result specifiers in case of normal bootstrapping. Note 2: For contrieved geometries, it is a good idea to double-check the ksi values and the selected scales if something goes amiss (ksi may increase at small scales). Note3: Using this selection mode takes some extra cpu.\n\
                          #  f: (default, no need to specify) Fast-but-not-too-wrong estimator for the confidence intervals. This is Fast-and-exact only when the same normal is used, when each cloud is totally independant, and the points distances to their planes are distributed according to a Gaussian in each cylinder. These assumptions may fail, in which case use either the bootstrap technique (recommended) or maintain a Gaussian assumption and allow for normals to differ (g experimental flag, not recommended)\n\
                          #  g: EXPERIMENTAL. Assume a normal (Gaussian) distribution of the point distances around the mean shift(1/2) values for estimating the confidence interval of the diff values, but allow the normals to differ. The worst case relies on monte-carlo sampling of the joint distribution, which may be slower and less precise than boostrapping. This option dos not take into account the e flag.\n\
+                         #  l: Limit the number of points used for computing the normals to this value. When a neighborhood has more points, a deterministic, spatially stratified subsample is used instead. This bounds the time spent on core points in very dense areas. The ns1/ns2 results still report the true numbers of neighbors.\n\
                          #  w: show extra warnings.\n\
-  input: extra_info      # Extra parameters for the \"e\", \"s\", \"b\", \"n\", \"c\", \"k\" and \"p\" flags,\n\
+  input: extra_info      # Extra parameters for the \"e\", \"s\", \"b\", \"n\", \"c\", \"k\", \"l\" and \"p\" flags,\n\
                          # given in the same order as these flags were specified.\n\
                          # Ex: m3c2 (all other opts) ehb 1e-2 1000\n\
                          # The flags are \"e\", \"h\" and \"b\". \"h\" has no extra parameter.\n\
@@ -422,6 +423,7 @@ int main(int argc, char** argv) {
     bool use_BCa = false;
     int num_pt_sig = 10;
     double ksi_autoscale = 0;
+    int max_neighbors = 0;
     bool warnings = false;
     
     int np_prod_max = 10000;
@@ -458,6 +460,11 @@ int main(int argc, char** argv) {
                 case 'p': if (++extra_info_idx<argc) {
                     num_pt_sig = atoi(argv[extra_info_idx]); break;
                 } else return help("Missing value for the p flag");
+                case 'l': if (++extra_info_idx<argc) {
+                    max_neighbors = atoi(argv[extra_info_idx]);
+                    if (max_neighbors<3) return help("Invalid value for the l flag, shall be at least 3");
+                    break;
+                } else return help("Missing value for the l flag");
 /*                case 's': if (extra_info_idx+3<argc) {
                     systematic_error.x = atof(argv[++extra_info_idx]);
                     systematic_error.y = atof(argv[++extra_info_idx]);
@@ -638,6 +645,35 @@ int main(int argc, char** argv) {
     int num_nan_c1 = 0;
     int num_nan_c2 = 0;
     
+    // clouds used for the normal computations, the neighbor indices refer to these
+    PointCloud<Point>& pn1 = p1reducedfname.empty() ? p1 : p1reduced;
+    PointCloud<Point>& pn2 = p2reducedfname.empty() ? p2 : p2reduced;
+    PointCloud<Point>* normal_cloud_ref[2] = {&pn1, &pn2};
+
+    // scratch space reused from one core point to the next, so the capacity
+    // grown on dense areas is kept instead of reallocated for every point
+    vector<NeighborIndex> neighbors_1, neighbors_2;
+    vector<NeighborIndex> capped_1, capped_2;
+    vector<int> capped_scratch;
+    vector<int> neigh_num_1, neigh_num_2;
+    vector<Point> neighsums_1, neighsums_2;
+    vector<double> A_scan, Acopy_scan;
+    vector<Point> normal_bs_sample1, normal_bs_sample2;
+    if (compute_normal_angles) {
+        normal_bs_sample1.resize(num_normal_bootstrap_iter);
+        normal_bs_sample2.resize(num_normal_bootstrap_iter);
+    }
+    vector<double> A1, A2, A1copy, A2copy;
+    vector<double> distances_along_axis_1, distances_along_axis_2;
+    vector<double> daa1_bs, daa2_bs;
+    vector<double> sample_deltanorm, samples, bs_samples;
+
+    // closest ref point of each core point, shared for all bootstrap iterations
+    PointCloud<Point> refcloud;
+    refcloud.load_points(refpoints);
+    vector<int> nearestref(corepoints.size());
+    if (!corepoints.empty()) refcloud.findNearestNeighbors(&corepoints[0], corepoints.size(), 1, &nearestref[0]);
+
     // for each core point
     int nextpercentcomplete = 5;
     for (int ptidx = 0; ptidx < (int)corepoints.size(); ++ptidx) {
@@ -657,9 +693,8 @@ int main(int argc, char** argv) {
         // the difference does not matter (we're at scale +- pos_dev instead of scale)
         // and the computations should be much faster!
         
-        vector<DistPoint<Point> > neighbors_1, neighbors_2;
-        vector<int> neigh_num_1(nscales,0), neigh_num_2(nscales,0);
-        vector<Point> neighsums_1, neighsums_2;
+        neighbors_1.clear(); neighbors_2.clear();
+        neigh_num_1.assign(nscales,0); neigh_num_2.assign(nscales,0);
         
         if (!force_vertical)
         // Scales are sorted from max to lowest
@@ -669,30 +704,24 @@ int main(int argc, char** argv) {
                 // we have all neighbors, unsorted, but with distances computed already
                 // use scales = diameters, not radius
                 if (!shift_second) {
-                    if (p1reducedfname.empty())
-                        p1.findNeighbors(back_inserter(neighbors_1), corepoints[ptidx], scalesvec[scaleidx] * 0.5);
-                    else 
-                        p1reduced.findNeighbors(back_inserter(neighbors_1), corepoints[ptidx], scalesvec[scaleidx] * 0.5);
+                    pn1.findNeighborIndices(neighbors_1, corepoints[ptidx], scalesvec[scaleidx] * 0.5);
                     // Sort the neighbors from closest to farthest, so we can process all lower scales easily
                     if (nscales>1) sort(neighbors_1.begin(), neighbors_1.end());
                     neigh_num_1[scaleidx] = neighbors_1.size();
                     // pre-compute cumulated sums
                     // so we might as well share the intermediates to lower levels
                     neighsums_1.resize(neighbors_1.size());
-                    if (!neighbors_1.empty()) neighsums_1[0] = *neighbors_1[0].pt;
-                    for (int i=1; i<(int)neighbors_1.size(); ++i) neighsums_1[i] = neighsums_1[i-1] + *neighbors_1[i].pt;
+                    if (!neighbors_1.empty()) neighsums_1[0] = pn1.data[neighbors_1[0].idx];
+                    for (int i=1; i<(int)neighbors_1.size(); ++i) neighsums_1[i] = neighsums_1[i-1] + pn1.data[neighbors_1[i].idx];
                 }
                 if (!shift_first) {
-                    if (p2reducedfname.empty())
-                        p2.findNeighbors(back_inserter(neighbors_2), corepoints[ptidx], scalesvec[scaleidx] * 0.5);
-                    else
-                        p2reduced.findNeighbors(back_inserter(neighbors_2), corepoints[ptidx], scalesvec[scaleidx] * 0.5);
+                    pn2.findNeighborIndices(neighbors_2, corepoints[ptidx], scalesvec[scaleidx] * 0.5);
                     // Sort the neighbors from closest to farthest, so we can process all lower scales easily
                     if (nscales>1) sort(neighbors_2.begin(), neighbors_2.end());
                     neigh_num_2[scaleidx] = neighbors_2.size();
                     neighsums_2.resize(neighbors_2.size());
-                    if (!neighbors_2.empty()) neighsums_2[0] = *neighbors_2[0].pt;
-                    for (int i=1; i<(int)neighbors_2.size(); ++i) neighsums_2[i] = neighsums_2[i-1] + *neighbors_2[i].pt;
+                    if (!neighbors_2.empty()) neighsums_2[0] = pn2.data[neighbors_2[0].idx];
+                    for (int i=1; i<(int)neighbors_2.size(); ++i) neighsums_2[i] = neighsums_2[i-1] + pn2.data[neighbors_2[i].idx];
                 }
             }
             // lower scale : restrict previously found neighbors to the new distance
@@ -745,33 +774,42 @@ int main(int argc, char** argv) {
             // avoid code dup below
             // but some dup in bootstrapping as I'm lazy to get rid of it
             int* normal_scale_idx_ref[2] = {&normal_scale_idx_1, &normal_scale_idx_2};
-            vector<DistPoint<Point> >* neighbors_ref[2] = {&neighbors_1, &neighbors_2};
+            vector<NeighborIndex>* neighbors_ref[2] = {&neighbors_1, &neighbors_2};
             vector<int>* neigh_num_ref[2] = {&neigh_num_1, &neigh_num_2};
             vector<Point>* neighsums_ref[2] = {&neighsums_1, &neighsums_2};
             // loop on both pt sets, unless shift1/2 specified
             for (int ref12_idx = ref12_idx_begin; ref12_idx < ref12_idx_end; ++ref12_idx) {
-                vector<DistPoint<Point> >& neighbors = *neighbors_ref[ref12_idx];
+                vector<NeighborIndex>& neighbors = *neighbors_ref[ref12_idx];
                 double maxbarycoord = -numeric_limits<double>::max();
                 // init to largest scale in case ksi condition is never verified below
                 if (ksi_autoscale>0) *normal_scale_idx_ref[ref12_idx] = 0;
                 for (int sidx=0; sidx<nscales; ++sidx) {
                     int npts = (*neigh_num_ref[ref12_idx])[sidx];
                     if (npts>=3) {
+                        const NeighborIndex* pcaneighbors = &neighbors[0];
                         // use the pre-computed sums to get the average point
                         Point avg = (*neighsums_ref[ref12_idx])[npts-1] / npts;
+                        // bounded cost: use a stratified subsample in very dense areas
+                        if (max_neighbors>0 && npts>max_neighbors) {
+                            vector<NeighborIndex>& capped = (ref12_idx==0) ? capped_1 : capped_2;
+                            normal_cloud_ref[ref12_idx]->stratifiedSubsample(pcaneighbors, npts, corepoints[ptidx], scalesvec[sidx] * 0.5, max_neighbors, capped, capped_scratch);
+                            pcaneighbors = &capped[0];
+                            npts = max_neighbors;
+                            avg = 0;
+                            for (int i=0; i<npts; ++i) avg += normal_cloud_ref[ref12_idx]->data[capped[i].idx];
+                            avg /= npts;
+                        }
                         // compute PCA on the neighbors at this scale
                         // a copy is needed as LAPACK destroys the matrix, and the center changes anyway
                         // => cannot keep the points from one scale to the lower, need to rebuild the matrix
-                        vector<double> A(npts * 3);
-                        for (int i=0; i<npts; ++i) {
-                            // A is column-major
-                            A[i] = neighbors[i].pt->x - avg.x;
-                            A[i+npts] = neighbors[i].pt->y - avg.y;
-                            A[i+npts*2] = neighbors[i].pt->z - avg.z;
-                        }
+                        vector<double>& A = A_scan;
+                        A.resize(npts * 3);
+                        // A is column-major
+                        normal_cloud_ref[ref12_idx]->gatherCentered(pcaneighbors, npts, avg, &A[0]);
                         
                         if (ksi_autoscale>0) {
-                            vector<double> Acopy = A;
+                            vector<double>& Acopy = Acopy_scan;
+                            Acopy = A;
                             svd(npts, 2, &Acopy[0], &svalues[0], false, &eigenvectors[0]);
                             Point e1(eigenvectors[0], eigenvectors[3], eigenvectors[6]);
                             Point e2(eigenvectors[1], eigenvectors[4], eigenvectors[7]);
@@ -829,46 +867,40 @@ int main(int argc, char** argv) {
             } //ref12 loop
         }
 
-        // closest ref point is also shared for all bootstrap iterations for efficiency
         // non-empty set => valid index
-        int nearestidx = -1;
-        double mindist = numeric_limits<double>::max();
-        for (int i=0; i<(int)refpoints.size(); ++i) {
-            double d = dist2(refpoints[i],corepoints[ptidx]);
-            if (d<mindist) {
-                mindist = d;
-                nearestidx = i;
-            }
-        }
-
-        Point& refpt = refpoints[nearestidx];
+        Point& refpt = refpoints[nearestref[ptidx]];
         Point deltaref = refpt - corepoints[ptidx];
         if (force_horizontal) deltaref.z = 0;
         deltaref.normalize();
             
         Point normal_1, normal_2;
         
-        vector<Point> *normal_bs_sample1 = 0;
-        vector<Point> *normal_bs_sample2 = 0;
-        if (compute_normal_angles) {
-            normal_bs_sample1 = new vector<Point>(num_normal_bootstrap_iter);
-            normal_bs_sample2 = new vector<Point>(num_normal_bootstrap_iter);
-        }
-        
         double normal_dev1 = 0, normal_dev2 = 0;
         
         // largest possible A, reused at each bootstrap step
-        vector<double> A1(neigh_num_1[0] * 3);
-        vector<double> A2(neigh_num_2[0] * 3);
+        A1.resize(neigh_num_1[0] * 3);
+        A2.resize(neigh_num_2[0] * 3);
         vector<double>* A_ref[2] = {&A1, &A2};
         // lapack destroys the matrix, we need it for compute_normal_plane_dev
-        vector<double> A1copy(0), A2copy(0);
         if (compute_normal_plane_dev) {
             A1copy.resize(A1.size());
             A2copy.resize(A2.size());
         }
         vector<double>* Acopy_ref[2] = {&A1copy, &A2copy};
 
+        // neighbors at the normal scales, possibly limited to a stratified subsample
+        const NeighborIndex* normal_neighbors[2] = {neighbors_1.empty() ? 0 : &neighbors_1[0], neighbors_2.empty() ? 0 : &neighbors_2[0]};
+        int normal_npts[2] = {neigh_num_1[normal_scale_idx_1], neigh_num_2[normal_scale_idx_2]};
+        if (max_neighbors>0) {
+            int normal_sidx[2] = {normal_scale_idx_1, normal_scale_idx_2};
+            vector<NeighborIndex>* capped_ref[2] = {&capped_1, &capped_2};
+            for (int ref12_idx = 0; ref12_idx < 2; ++ref12_idx) if (normal_npts[ref12_idx]>max_neighbors) {
+                normal_cloud_ref[ref12_idx]->stratifiedSubsample(normal_neighbors[ref12_idx], normal_npts[ref12_idx], corepoints[ptidx], scalesvec[normal_sidx[ref12_idx]] * 0.5, max_neighbors, *capped_ref[ref12_idx], capped_scratch);
+                normal_neighbors[ref12_idx] = &(*capped_ref[ref12_idx])[0];
+                normal_npts[ref12_idx] = max_neighbors;
+            }
+        }
+
         // We have all core point neighbors at all scales in each data set
         // and the correct scales for the computation
         // Now bootstrapping...
@@ -886,8 +918,6 @@ int main(int argc, char** argv) {
             int* normal_scale_idx_ref[2] = {&normal_scale_idx_1, &normal_scale_idx_2};
             Point* normal_ref[2] = {&normal_1, &normal_2};
             Point* normal_bs_ref[2] = {&normal_bs_1, &normal_bs_2};
-            vector<DistPoint<Point> >* neighbors_ref[2] = {&neighbors_1, &neighbors_2};
-            vector<int>* neigh_num_ref[2] = {&neigh_num_1, &neigh_num_2};
             vector<Point>* resampled_neighbors_ref[2] = {&resampled_neighbors_1, &resampled_neighbors_2};
             double* normal_dev_ref[2] = {&normal_dev1, &normal_dev2};
             int npts_scaleN_1 = 0, npts_scaleN_2 = 0;
@@ -903,9 +933,10 @@ int main(int argc, char** argv) {
                     if (!compute_normal_plane_dev) continue;
                 }
 
-                vector<DistPoint<Point> >& neighbors = *neighbors_ref[ref12_idx];
+                const NeighborIndex* neighbors = normal_neighbors[ref12_idx];
+                PointCloud<Point>& ncloud = *normal_cloud_ref[ref12_idx];
                 int normal_sidx = *normal_scale_idx_ref[ref12_idx];
-                int npts_scale_base = (*neigh_num_ref[ref12_idx])[normal_sidx];
+                int npts_scale_base = normal_npts[ref12_idx];
                 Point avg = 0;
                 vector<double>& A = *A_ref[ref12_idx];
                 vector<double>& Acopy = *Acopy_ref[ref12_idx];
@@ -914,11 +945,11 @@ int main(int argc, char** argv) {
                 double radiussq = scalesvec[normal_sidx] * scalesvec[normal_sidx] * 0.25;
                 Point bspt;
                 for (int i=0; i<npts_scale_base; ++i) {
-                    Point* pt = neighbors[i].pt;
+                    Point* pt = &ncloud.data[neighbors[i].idx];
                     if (num_normal_bootstrap_iter>1) {
                         //int selectedidx = randint();
                         int selectedidx = randint(npts_scale_base);
-                        pt = neighbors[selectedidx].pt;
+                        pt = &ncloud.data[neighbors[selectedidx].idx];
                         // add some gaussian noise with dev specified by the user on each coordinate
                         if (pos_dev>0 && !force_vertical) {
                             bspt = *pt;
@@ -1039,8 +1070,8 @@ int main(int argc, char** argv) {
             normal_2 += normal_bs_2;
             
             if (compute_normal_angles) {
-                (*normal_bs_sample1)[n_bootstrap_iter] = normal_bs_1;
-                (*normal_bs_sample2)[n_bootstrap_iter] = normal_bs_2;
+                normal_bs_sample1[n_bootstrap_iter] = normal_bs_1;
+                normal_bs_sample2[n_bootstrap_iter] = normal_bs_2;
             }
         }
         
@@ -1057,20 +1088,18 @@ int main(int argc, char** argv) {
         if (compute_normal_angles) {
             double dprod1 = 0, dprod2 = 0;
             for (int n_bootstrap_iter = 0; n_bootstrap_iter < num_normal_bootstrap_iter; ++n_bootstrap_iter) {
-                dprod1 += (*normal_bs_sample1)[n_bootstrap_iter].dot(normal_1);
-                dprod2 += (*normal_bs_sample2)[n_bootstrap_iter].dot(normal_2);
+                dprod1 += normal_bs_sample1[n_bootstrap_iter].dot(normal_1);
+                dprod2 += normal_bs_sample2[n_bootstrap_iter].dot(normal_2);
             }
             n1angle_bs = acos(dprod1 / num_normal_bootstrap_iter) * 180 / M_PI;
             n2angle_bs = acos(dprod2 / num_normal_bootstrap_iter) * 180 / M_PI;
-            delete normal_bs_sample1;
-            delete normal_bs_sample2;
         }
         
         /// estimate the diff separately from the normals
         /// First get all points in the cylinder
         /// then bootstrap to estimate the variance around the core shift distance
-        vector<double> distances_along_axis_1;
-        vector<double> distances_along_axis_2;
+        distances_along_axis_1.clear();
+        distances_along_axis_2.clear();
         Point* normal_ref[2] = {&normal_1, &normal_2};
         vector<double>* distances_along_axis_ref[2] = {&distances_along_axis_1, &distances_along_axis_2};
         
@@ -1117,8 +1146,10 @@ int main(int argc, char** argv) {
             daa1 = &distances_along_axis_1;
             daa2 = &distances_along_axis_2;
         } else {
-            daa1 = new vector<double>(np1);
-            daa2 = new vector<double>(np2);
+            daa1_bs.resize(np1);
+            daa2_bs.resize(np2);
+            daa1 = &daa1_bs;
+            daa2 = &daa2_bs;
         }
 
         // allow for some small numerical roundoff errors
@@ -1165,7 +1196,7 @@ int main(int argc, char** argv) {
             // use the quartiles for the confidence_interval_percent then
             if (use_median && (normal_ci || (num_bootstrap_iter==1))) {
                 // rely on random sampling when there are too many combinations
-                vector<double> sample_deltanorm(min(np1*np2,np_prod_max),0.);
+                sample_deltanorm.assign(min(np1*np2,np_prod_max),0.);
                 if (np1*np2>np_prod_max) for (int i=0; i<np_prod_max; ++i) {
                     double d1 = distances_along_axis_1[randint(np1)];
                     double d2 = distances_along_axis_2[randint(np2)];
@@ -1192,7 +1223,7 @@ int main(int argc, char** argv) {
             }
             if (!use_median) {
                 int nsamples = np1*np2;
-                vector<double> samples(0);
+                samples.clear();
                 if (fast_ci || (same_normal && !use_BCa)) {
                     if (fast_ci || num_bootstrap_iter==1) {
                         mean_dev(&distances_along_axis_1[0], np1, c1shift, c1dev);
@@ -1252,9 +1283,9 @@ int main(int argc, char** argv) {
                     // which is more than enough for quantile estimation
                     // hope to use a fine enough discretization...
                     // ...at every 0.02 quantile in each dist, shall be OK
-                    vector<double> x1(50), x2(50), p1(50), p2(50);
+                    double x1[50] = {}, x2[50] = {}, p1[50] = {}, p2[50] = {};
                     struct DP {double d, p;};
-                    vector<DP> dp(49*49, {0.,0.});
+                    DP dp[49*49] = {};
                     for (int i=1; i<=49; ++i) {
                         x1[i] = quantile(G1,i * 0.02);
                         p1[i] = pdf(G1,x1[i]);
@@ -1347,7 +1378,8 @@ int main(int argc, char** argv) {
                 devd1 = interquartile(&(*daa1)[0], daa1->size());
                 devd2 = interquartile(&(*daa2)[0], daa2->size());
                 int nsamples = min(np1*np2,np_prod_max);
-                vector<double> samples(nsamples);
+                vector<double>& samples = bs_samples;
+                samples.resize(nsamples);
                 for (int sidx=0; sidx<nsamples; ++sidx) {
                     int i1, i2;
                     if (nsamples==np_prod_max) {
@@ -1414,7 +1446,6 @@ int main(int argc, char** argv) {
             c2shift /= num_bootstrap_iter;
             c2dev /= num_bootstrap_iter;
             diff /= num_bootstrap_iter;
-            delete daa1; delete daa2;
             diff_bsdev = sqrt( (diff_bsdev - diff*diff*num_bootstrap_iter)/(num_bootstrap_iter-1.0) );
             c1shift_bsdev = sqrt( (c1shift_bsdev - c1shift*c1shift*num_bootstrap_iter)/(num_bootstrap_iter-1.0) );
             c2shift_bsdev = sqrt( (c2shift_bsdev - c2shift*c2shift*num_bootstrap_iter)/(num_bootstrap_iter-1.0) );
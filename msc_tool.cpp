@@ -24,6 +24,7 @@
 #include <iostream>
 #include <limits>
 #include <fstream>
+#include <algorithm>
 
 #include <boost/format.hpp>
 
@@ -33,21 +34,40 @@
 #include "base64.hpp"
 #include "helpers.hpp"
 #include "classifier.hpp"
+#include "formatting.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
 int help(const char* errmsg = 0) {
 cout << "\
-msc_tool   cmd file1.msc [file2.msc ...] ( : file.prm [out.svg [kernel_dev [classifnum]]] | file_out.xyz [...] )\n\
+msc_tool   cmd file1.msc [file2.msc ...] ( : file.prm [out.svg [kernel_dev [classifnum]]] | : file_out.xyz [...] [: scales] )\n\
+msc_tool   extract file.msc : out.msc scales\n\
+msc_tool   merge file1.msc file2.msc [...] : out.msc\n\
+msc_tool   select file.msc : out.msc ( bbox xmin xmax ymin ymax [zmin zmax] | index indices.txt )\n\
+msc_tool   convert file.msc : out.msc ( v1 | v2 | v2half | v2uint16 )\n\
   input: cmd            # A command to execute on the msc file:\n\
                         # \"info\": display information of the given msc files and quit\n\
                         # \"project\": project the given msc files on the parameter space provided by the given prm file. Write the result in out.svg.\n\
                         # \"xyz\": convert the given msc files to text format in file_out.xyz\n\
+                        # \"extract\": write a msc file with only the given scales, in that order\n\
+                        # \"merge\": concatenate msc files with the same scales\n\
+                        # \"select\": write a msc file with only the core points in the bounding box,\n\
+                        # or at the indices (counting from 0) listed in the indices.txt text file\n\
+                        # \"convert\": rewrite a msc file in another format version. v1 is the original\n\
+                        # format, readable by older programs. v2 stores the values by columns so a\n\
+                        # program reads only the scales it needs. v2half and v2uint16 store the\n\
+                        # a,b values in 16 bits (lossy): half floats, or fixed point within [0,1]\n\
   input: file.msc       # the multiscale file to consider\n\
   input: file.prm       # (info, project) if given, displays information about the parameter file as well\n\
   output: out.svg       # (project) the msc file in the classifier parameter space\n\
                         # and produce a density visualisation of the points contained\n\
                         # in the msc file\n\
+                        # A name ending in .png writes the image only, with the\n\
+                        # decision boundary drawn in it but not editable.\n\
   input: kernel_dev     # (project) the standard deviation of the gaussian kernel used\n\
                         # for computing the density, in pixels. Default is 0 = do not use a kernel.\n\
   input: classifnum     # the classifier number to use for multi-classifier parameter\n\
@@ -55,6 +75,8 @@ msc_tool   cmd file1.msc [file2.msc ...] ( : file.prm [out.svg [kernel_dev [clas
   output: file_out.xyz  # (xyz) convert the msc file to a text format containing\n\
                         # the position of the core points and the associated multiscale\n\
                         # values as extra columns\n\
+  input: scales         # (xyz) only write the a,b,c values and number of neighbors\n\
+                        # at these scales, in this order. Default is all scales.\n\
 "<<endl;
     if (errmsg) cout << "Error: " << errmsg << endl;
         return 0;
@@ -111,13 +133,171 @@ cairo_status_t png_copier(void *closure, const unsigned char *data, unsigned int
     return CAIRO_STATUS_SUCCESS;
 }
 
+// Records are copied by blocks from the input files, without recomputing anything.
+// extract keeps only some scales, merge concatenates the files, select keeps the
+// points in a bounding box or at given indices
+int msc_slice(int argc, char** argv, int arg_separator, bool cmd_extract, bool cmd_merge, bool inconsistent) {
+    static const int block_records = 1<<18;
+    bool cmd_select = !cmd_extract && !cmd_merge;
+    int nmscfiles = arg_separator - 2;
+    if (!cmd_merge && nmscfiles!=1) return help("Need a single input msc file.");
+    if (cmd_merge && inconsistent) return help("Merging msc files with different scales is not possible.");
+    string outname = argv[arg_separator+1];
+    for (int argi=2; argi<arg_separator; ++argi) if (outname==argv[argi]) return help("The output file must differ from the input files.");
+
+    // extract: output scale indices
+    vector<int> columns;
+    // select: bounding box, or sorted unique indices
+    vector<FloatType> bbox;
+    vector<int> indices;
+    bool use_indices = false;
+    if (cmd_select) {
+        if (argc<arg_separator+3) return help("Need a selection for the select command.");
+        if (!strcmp(argv[arg_separator+2],"bbox")) {
+            for (int argi=arg_separator+3; argi<argc; ++argi) bbox.push_back(atof(argv[argi]));
+            if (bbox.size()!=4 && bbox.size()!=6) return help("The bounding box is xmin xmax ymin ymax [zmin zmax].");
+            for (int i=0; i<(int)bbox.size(); i+=2) if (bbox[i]>bbox[i+1]) return help("Invalid bounding box.");
+        } else if (!strcmp(argv[arg_separator+2],"index")) {
+            if (argc<arg_separator+4) return help("Need a file with the point indices.");
+            ifstream indexfile(argv[arg_separator+3]);
+            if (!indexfile) return help("Could not read the index file.");
+            int idx;
+            while (indexfile >> idx) indices.push_back(idx);
+            sort(indices.begin(), indices.end());
+            indices.erase(unique(indices.begin(), indices.end()), indices.end());
+            use_indices = true;
+        } else return help("The selection is either bbox or index.");
+    }
+
+    ofstream outfile(outname.c_str(), ofstream::binary);
+    vector<FloatType> out_scales;
+    int out_npts = 0;
+    int out_ptnparams = 0;
+    int base_idx = 0;
+    size_t next_index = 0;
+    vector<char> outblock;
+    for (int argi=2; argi<arg_separator; ++argi) {
+        MSCFile mscfile(argv[argi]);
+        vector<FloatType> scales;
+        int ptnparams;
+        int npts = read_msc_header(mscfile, scales, ptnparams);
+        int nscales = scales.size();
+        size_t recsize = msc_record_size(nscales, ptnparams);
+        if (argi>2 && ptnparams!=out_ptnparams) return help("Merging msc files with different core point parameters is not possible.");
+        out_ptnparams = ptnparams;
+        if (argi==2) {
+            if (cmd_extract) {
+                for (int argj=arg_separator+2; argj<argc; ++argj) {
+                    FloatType scale = atof(argv[argj]);
+                    int found = -1;
+                    for (int si=0; si<nscales; ++si) if (fpeq(scale,scales[si])) {found = si; break;}
+                    if (found==-1) return help("A requested scale is not present in the msc file.");
+                    columns.push_back(found);
+                    out_scales.push_back(scales[found]);
+                }
+                if (columns.empty()) return help("Need the scales to extract.");
+            }
+            else out_scales = scales;
+            if (cmd_select && !use_indices && ptnparams<3) return help("The msc file does not contain the point coordinates.");
+            // the number of points is set at the end
+            write_msc_header(outfile, 0, out_scales, ptnparams);
+        }
+        int out_nscales = out_scales.size();
+        size_t out_recsize = msc_record_size(out_nscales, ptnparams);
+        int nrecords;
+        for (int blockbegin = 0; blockbegin < npts; blockbegin += nrecords) {
+            nrecords = min(block_records, npts - blockbegin);
+            if (cmd_extract) {
+                // only the columns of the extracted scales are read
+                MSCRecords block = read_msc_columns(mscfile, blockbegin, nrecords, columns);
+                nrecords = block.npts;
+                outblock.resize(nrecords * out_recsize);
+                gather_msc_records(block, &outblock[0]);
+                outfile.write(&outblock[0], outblock.size());
+                out_npts += nrecords;
+                continue;
+            }
+            const char* block = read_msc_records(mscfile, nrecords);
+            if (cmd_merge) {
+                outfile.write(block, nrecords * recsize);
+                out_npts += nrecords;
+                continue;
+            }
+            outblock.resize(nrecords * out_recsize);
+            char* out = &outblock[0];
+            for (int rec = 0; rec < nrecords; ++rec) {
+                const char* record = block + rec * recsize;
+                // select
+                bool keep;
+                if (use_indices) {
+                    int idx = base_idx + blockbegin + rec;
+                    while (next_index<indices.size() && indices[next_index]<idx) ++next_index;
+                    keep = next_index<indices.size() && indices[next_index]==idx;
+                } else {
+                    FloatType coords[3];
+                    // records need not be aligned
+                    memcpy(coords, record, sizeof(coords));
+                    keep = true;
+                    for (int i=0; i<(int)bbox.size(); i+=2) if (coords[i/2]<bbox[i] || coords[i/2]>bbox[i+1]) keep = false;
+                }
+                if (!keep) continue;
+                memcpy(out, record, recsize);
+                out += recsize;
+            }
+            outfile.write(&outblock[0], out - &outblock[0]);
+            out_npts += (out - &outblock[0]) / out_recsize;
+        }
+        base_idx += npts;
+    }
+    outfile.seekp(0);
+    outfile.write((char*)&out_npts, sizeof(int));
+    outfile.close();
+    cout << "Wrote " << out_npts << " points at " << out_scales.size() << " scales in " << outname << endl;
+    if (out_npts==0) cout << "Warning: the output msc file contains no point and is not usable by the other programs." << endl;
+    return 0;
+}
+
+// rewrites a msc file in the given format version and encoding
+int msc_convert(int argc, char** argv, int arg_separator) {
+    if (arg_separator!=3) return help("Need a single input msc file.");
+    if (argc<arg_separator+3) return help("Need the output format: v1, v2, v2half or v2uint16.");
+    string format = argv[arg_separator+2];
+    int abencoding = MSC_AB_FLOAT;
+    if (format=="v2half") abencoding = MSC_AB_HALF;
+    else if (format=="v2uint16") abencoding = MSC_AB_UINT16;
+    else if (format!="v1" && format!="v2") return help("Invalid output format.");
+    if (!strcmp(argv[2], argv[arg_separator+1])) return help("The output file must differ from the input file.");
+    MSCFile mscfile(argv[2]);
+    vector<FloatType> scales;
+    int ptnparams;
+    int npts = read_msc_header(mscfile, scales, ptnparams);
+    ofstream outfile(argv[arg_separator+1], ofstream::binary);
+    if (format=="v1") {
+        static const int block_records = 1<<18;
+        write_msc_header(outfile, npts, scales, ptnparams);
+        size_t recsize = msc_record_size(scales.size(), ptnparams);
+        for (int blockbegin = 0; blockbegin < npts; blockbegin += block_records) {
+            int nrecords = min(block_records, npts - blockbegin);
+            outfile.write(read_msc_records(mscfile, nrecords), nrecords * recsize);
+        }
+    }
+    else write_msc_v2(outfile, npts, scales, ptnparams, abencoding, [&](int nrecords) {return read_msc_records(mscfile, nrecords);});
+    outfile.close();
+    cout << "Converted " << npts << " points to format " << format << " in " << argv[arg_separator+1] << endl;
+    return 0;
+}
+
 int main(int argc, char** argv) {
     if (argc<3) return help();
         
     bool cmd_info = !strcmp(argv[1],"info");
     bool cmd_project = !strcmp(argv[1],"project");
     bool cmd_xyz = !strcmp(argv[1],"xyz");
-    if (!cmd_info && !cmd_project && !cmd_xyz) return help();
+    bool cmd_extract = !strcmp(argv[1],"extract");
+    bool cmd_merge = !strcmp(argv[1],"merge");
+    bool cmd_select = !strcmp(argv[1],"select");
+    bool cmd_convert = !strcmp(argv[1],"convert");
+    if (!cmd_info && !cmd_project && !cmd_xyz && !cmd_extract && !cmd_merge && !cmd_select && !cmd_convert) return help();
     
     int arg_separator = -1;
     for (int argi = 2; argi<argc; ++argi) if (!strcmp(argv[argi],":")) {
@@ -144,6 +324,10 @@ int main(int argc, char** argv) {
         for (int si=0; si<scales_thisfile.size(); ++si) cout << " " << scales_thisfile[si];
         cout << endl;
         cout << "  " << (ptnparams-3) << " additional fields from original core points" << endl;
+        if (mscfile.version==2) {
+            static const char* encodings[] = {"full precision", "half floats", "16-bit quantized"};
+            cout << "  format version 2, " << mscfile.blockoffsets.size() << " blocks of " << mscfile.blocksize << " points, a,b values in " << encodings[mscfile.abencoding] << endl;
+        }
 
         if (scales_thisfile.empty()) inconsistent = true;
         if (scales.empty()) scales = scales_thisfile;
@@ -155,59 +339,91 @@ int main(int argc, char** argv) {
         if (cmd_info) return 0; // done
         if (cmd_project) return help("Need a parameter file defining the projection.");
         if (cmd_xyz) return help("Need a xyz file name to write to.");
+        return help("Need a msc file name to write to.");
     }
+
+    if (cmd_convert) return msc_convert(argc, argv, arg_separator);
+    if (cmd_extract || cmd_merge || cmd_select) return msc_slice(argc, argv, arg_separator, cmd_extract, cmd_merge, inconsistent);
     
     int nscales = scales.size();
     int fdim = nscales * 2;
 
     if (cmd_xyz) {
         int nmscfiles = arg_separator - 2;
-        if (nmscfiles != argc-arg_separator-1) return help("Need the same number of output files as there are input msc files.");
+        // optional selection of the scales to write, after a second separator
+        int scale_separator = argc;
+        for (int argi = arg_separator+1; argi<argc; ++argi) if (!strcmp(argv[argi],":")) {
+            scale_separator = argi;
+            break;
+        }
+        if (nmscfiles != scale_separator-arg_separator-1) return help("Need the same number of output files as there are input msc files.");
+        vector<FloatType> selected_scales;
+        for (int argi = scale_separator+1; argi<argc; ++argi) {
+            FloatType scale = atof(argv[argi]);
+            if (scale<=0) return help("Invalid scale");
+            selected_scales.push_back(scale);
+        }
+        if (scale_separator<argc && selected_scales.empty()) return help("Need the scales to write after the second separator.");
         for (int msci = 0; msci < nmscfiles; ++msci) {
-            ifstream mscfile(argv[2+msci], ifstream::binary);
-            ofstream xyzfile(argv[arg_separator+1+msci]);
-            xyzfile.precision(20);
+            MSCFile mscfile(argv[2+msci]);
+            ofstream xyzfile(argv[arg_separator+1+msci], ofstream::binary);
             // read the file header
-            int ncorepoints;
-            mscfile.read((char*)&ncorepoints,sizeof(ncorepoints));
-            int nscales;
-            mscfile.read((char*)&nscales, sizeof(int));
-            for (int si=0; si<nscales; ++si) {
-                FloatType scale_msc;
-                mscfile.read((char*)&scale_msc, sizeof(FloatType));
-            }
-            int ptnparams;
-            mscfile.read((char*)&ptnparams, sizeof(int));
+            vector<FloatType> scales_msc;
+            int ncorepoints = read_msc_header(mscfile, scales_msc, ptnparams);
+            int nscales = scales_msc.size();
             if (ptnparams<3) {
                 cerr << "Multiscale file does not contain point coordinates!" << endl;
                 return 1;
             }
-            for (int pt=0; pt<ncorepoints; ++pt) {
-                FloatType x,y,z;
-                mscfile.read((char*)&x, sizeof(FloatType));
-                mscfile.read((char*)&y, sizeof(FloatType));
-                mscfile.read((char*)&z, sizeof(FloatType));
-                xyzfile << x << " " << y << " " << z;
-                for (int i=3; i<ptnparams; ++i) {
-                    FloatType param;
-                    mscfile.read((char*)&param, sizeof(FloatType));
-                    xyzfile << " " << param;
-                }
-                for (int s=0; s<nscales; ++s) {
-                    FloatType a,b;
-                    mscfile.read((char*)(&a), sizeof(FloatType));
-                    mscfile.read((char*)(&b), sizeof(FloatType));
-                    FloatType c = 1 - a - b;
-                    xyzfile << " " << a << " " << b << " " << c;
-                }
-                int nneigh;
-                for (int i=0; i<nscales; ++i) {
-                    mscfile.read((char*)&nneigh, sizeof(int));
-                    xyzfile << " " << nneigh;
+            vector<int> columns;
+            if (selected_scales.empty()) for (int si=0; si<nscales; ++si) columns.push_back(si);
+            else for (int i=0; i<(int)selected_scales.size(); ++i) {
+                int found = -1;
+                for (int si=0; si<nscales; ++si) if (fpeq(selected_scales[i],scales_msc[si])) {found = si; break;}
+                if (found==-1) cout << "Warning: requested scale " << selected_scales[i] << " is not present in " << argv[2+msci] << ", ignored" << endl;
+                else columns.push_back(found);
+            }
+            int ncolumns = columns.size();
+            // enough for each number and its separator
+            size_t maxlinesize = (ptnparams + ncolumns * 4) * format_max_chars + 1;
+            static const int block_records = 1<<18;
+            static const int chunk_records = 4096;
+            int nrecords;
+            for (int blockbegin = 0; blockbegin < ncorepoints; blockbegin += nrecords) {
+                // only the columns of the written scales are read
+                MSCRecords block = read_msc_columns(mscfile, blockbegin, min(block_records, ncorepoints - blockbegin), columns);
+                nrecords = block.npts;
+                int nchunks = (nrecords + chunk_records - 1) / chunk_records;
+                // each thread formats a chunk of records, written in order
+#pragma omp parallel
+{
+                vector<char> text(chunk_records * maxlinesize);
+#pragma omp for ordered schedule(dynamic,1)
+                for (int chunk = 0; chunk < nchunks; ++chunk) {
+                    char* p = &text[0];
+                    int recend = min(nrecords, (chunk+1) * chunk_records);
+                    for (int rec = chunk * chunk_records; rec < recend; ++rec) {
+                        for (int i=0; i<ptnparams; ++i) {
+                            if (i>0) *p++ = ' ';
+                            p = format_real_shortest(p, block.param(i)[rec]);
+                        }
+                        for (int ci=0; ci<ncolumns; ++ci) {
+                            FloatType a = block.a(ci)[rec], b = block.b(ci)[rec];
+                            FloatType c = 1 - a - b;
+                            *p++ = ' '; p = format_real_shortest(p, a);
+                            *p++ = ' '; p = format_real_shortest(p, b);
+                            *p++ = ' '; p = format_real_shortest(p, c);
+                        }
+                        for (int ci=0; ci<ncolumns; ++ci) {
+                            *p++ = ' '; p = format_int(p, block.nneigh(ci)[rec]);
+                        }
+                        *p++ = '\n';
+                    }
+#pragma omp ordered
+                    xyzfile.write(&text[0], p - &text[0]);
                 }
-                xyzfile << endl;
+}
             }
-            mscfile.close();
             xyzfile.close();
         }
         return 0;
@@ -308,32 +524,72 @@ int main(int argc, char** argv) {
     FloatType max_distance = kernel_dev * 3;
     FloatType scaleFactor = halfSvgSize / classifier.absmaxXY;
 
+    // TODO: match classifier scales with msc scales and allow files with
+    // different scales, so long as all necessary scales are present
+    ProjectionBank projbank;
+    projbank.prepare(&classifier, 1);
+    vector<FloatType> projab(npts * 2);
+    projbank.project(&data[0], fdim, 0, npts, &projab[0]);
+
+    // The points are first binned in pixels, in per-thread grids. The Gaussian
+    // is then applied to the binned counts, separately in x and y as
+    // exp(-(dx^2+dy^2)/var) = exp(-dx^2/var) * exp(-dy^2/var).
+    // The grid is extended by the kernel radius so the points just outside
+    // the image still contribute to its borders.
+    int radius = kernel_dev>0 ? (int)ceil(max_distance) : 0;
+    int gridSize = svgSize + 2 * radius;
+    int nthreads = 1;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    vector<int> threadcounts(nthreads * gridSize * gridSize, 0);
+#pragma omp parallel for schedule(static)
     for (int pi=0; pi<npts; ++pi) {
-        FloatType a, b;
-        
-        // TODO: match classifier scales with msc scales and allow files with
-        // different scales, so long as all necessary scales are present
-        classifier.project(&data[pi*fdim], a, b);
+        int thread = 0;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+#endif
+        FloatType a = projab[pi*2], b = projab[pi*2+1];
         FloatType x = a * scaleFactor + halfSvgSize;
         FloatType y = halfSvgSize - b * scaleFactor;
-        if (kernel_dev>0) {
-            for (int j = (int)floor(y-max_distance); j<=(int)floor(y+max_distance); ++j) {
-                if (j<0 || j>=svgSize) continue;
-                for (int i = (int)floor(x-max_distance); i<=(int)floor(x+max_distance); ++i) {
-                    if (i<0 || i>=svgSize) continue;
-                    double dx = i+0.5 - x;
-                    double dy = j+0.5 - y;
-                    density_grid[j * svgSize + i] += exp( - (dx*dx+dy*dy) / kernel_var );
-                }
+        int i = (int)floor(x) + radius; int j = (int)floor(y) + radius;
+        if (i<0 || i>=gridSize) continue;
+        if (j<0 || j>=gridSize) continue;
+        ++threadcounts[(thread * gridSize + j) * gridSize + i];
+    }
+    vector<double> counts(gridSize * gridSize, 0.0);
+    for (int thread = 0; thread < nthreads; ++thread) {
+        const int* tc = &threadcounts[thread * gridSize * gridSize];
+        for (int k = 0; k < gridSize * gridSize; ++k) counts[k] += tc[k];
+    }
+    vector<int>().swap(threadcounts);
+
+    if (kernel_dev>0) {
+        vector<double> kernel(2 * radius + 1);
+        for (int k = -radius; k <= radius; ++k) kernel[k + radius] = exp(- k * k / kernel_var);
+        // blur along x for the rows covering the image
+        vector<double> rowblur(gridSize * svgSize, 0.0);
+#pragma omp parallel for schedule(static)
+        for (int j = 0; j < gridSize; ++j) {
+            const double* in = &counts[j * gridSize];
+            double* out = &rowblur[j * svgSize];
+            for (int k = 0; k <= 2 * radius; ++k) {
+                double w = kernel[k];
+                for (int i = 0; i < svgSize; ++i) out[i] += w * in[i + k];
             }
         }
-        else {
-            int i = (int)floor(x); int j = (int)floor(y); 
-            if (i<0 || i>=svgSize) continue;
-            if (j<0 || j>=svgSize) continue;
-            ++density_grid[j * svgSize + i];
+        // then along y
+#pragma omp parallel for schedule(static)
+        for (int j = 0; j < svgSize; ++j) {
+            double* out = &density_grid[j * svgSize];
+            for (int k = 0; k <= 2 * radius; ++k) {
+                double w = kernel[k];
+                const double* in = &rowblur[(j + k) * svgSize];
+                for (int i = 0; i < svgSize; ++i) out[i] += w * in[i];
+            }
         }
     }
+    else density_grid.swap(counts);
     
     double min_density = npts; // all points in the same pixel
     double max_density = 0;
@@ -344,32 +600,29 @@ int main(int argc, char** argv) {
     }
     if (max_density <= min_density) max_density = min_density +1;
     
-    cout << "Writing the svg file..." << endl;
-    ofstream svgfile(argv[arg_separator+2]);
-    
+    // a png output file name gives the raster image directly, without the svg wrapper
+    string outname = argv[arg_separator+2];
+    bool png_output = outname.size()>4 && outname.substr(outname.size()-4)==".png";
+
     cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, svgSize, svgSize);
     cairo_t *cr = cairo_create(surface);
-/*    int surface_height = cairo_image_surface_get_height(surface);
-    int surface_width = cairo_image_surface_get_width(surface);
+    // set the pixels directly in the surface, in native-endian ARGB
+    cairo_surface_flush(surface);
     int surface_stride = cairo_image_surface_get_stride(surface);
-    unsigned char* surface_data = cairo_image_surface_get_data(surface);*/
+    unsigned char* surface_data = cairo_image_surface_get_data(surface);
+#pragma omp parallel for schedule(static)
     for (int j=0; j<svgSize; ++j) {
+        uint32_t* row = (uint32_t*)(surface_data + j * surface_stride);
         for (int i=0; i<svgSize; ++i) {
             //double density_01 = (density_grid[j*svgSize+i] - min_density) / (max_density - min_density);
             double density_01 = (log(density_grid[j*svgSize+i]+1) - log(min_density+1)) / (log(max_density+1) - log(min_density+1));
             int r,g,b;
             // low value = blue(hue=4/6), high = red(hue=0)
             hueToRGB(4./6. * (1.0 - density_01),r,g,b);
-            cairo_set_source_rgb(cr, r/256.0, g/256.0, b/256.0);
-            cairo_rectangle(cr,i,j,1,1);
-            cairo_stroke(cr);
-
-/*            surface_data[i*4+2] = r;
-            surface_data[i*4+1] = g;
-            surface_data[i*4+0] = b;*/
+            row[i] = 0xFF000000u | (r << 16) | (g << 8) | b;
         }
-//        surface_data += surface_stride;
     }
+    cairo_surface_mark_dirty(surface);
 
     cairo_set_source_rgb(cr, 0.25,0.25,0.25);
     cairo_select_font_face (cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
@@ -403,6 +656,31 @@ int main(int argc, char** argv) {
     cairo_line_to(cr, halfSvgSize,svgSize);
     cairo_stroke(cr);
 
+    if (png_output) {
+        cout << "Writing the png file..." << endl;
+        // the reference points and the decision boundary are drawn in the image
+        cairo_set_dash(cr, dashes, 0, 0);
+        cairo_set_source_rgb(cr, 0,0,0);
+        cairo_set_line_width(cr, 1);
+        cairo_arc(cr, classifier.refpt_pos.x*scaleFactor+halfSvgSize, halfSvgSize-classifier.refpt_pos.y*scaleFactor, 2, 0, 2*M_PI);
+        cairo_stroke(cr);
+        cairo_arc(cr, classifier.refpt_neg.x*scaleFactor+halfSvgSize, halfSvgSize-classifier.refpt_neg.y*scaleFactor, 2, 0, 2*M_PI);
+        cairo_stroke(cr);
+        for(int i=0; i<classifier.path.size(); ++i) {
+            FloatType px = classifier.path[i].x * scaleFactor + halfSvgSize;
+            FloatType py = halfSvgSize - classifier.path[i].y * scaleFactor;
+            if (i==0) cairo_move_to(cr, px, py); else cairo_line_to(cr, px, py);
+        }
+        cairo_stroke(cr);
+        cairo_surface_write_to_png(surface, outname.c_str());
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+        return 0;
+    }
+
+    cout << "Writing the svg file..." << endl;
+    ofstream svgfile(outname.c_str());
+
     svgfile << "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\""<< svgSize << "\" height=\""<< svgSize <<"\" >" << endl;
     vector<char> binary_parameters(
         sizeof(int)
@@ -174,6 +174,18 @@ struct DistPoint {
     DistPoint() : distsq(0), pt(0) {}
 };
 
+// compact neighbor record: index into the cloud data vector instead of a pointer
+// 8 bytes per neighbor with float distances instead of 16 for DistPoint on 64-bit systems
+struct NeighborIndex {
+    FloatType distsq;
+    IndexType idx;
+    bool operator<(const NeighborIndex& other) const {
+        return distsq < other.distsq;
+    }
+    NeighborIndex(FloatType _distsq, IndexType _idx) : distsq(_distsq), idx(_idx) {}
+    NeighborIndex() : distsq(0), idx(0) {}
+};
+
 // only classic notation supported, no fancy hex or the like that atof can handle
 // Usage: for (char* x = line; *x!=0;) {value = fast_atof_next_token(x); ... }
 // only classic notation supported, no fancy hex or the like that atof can handle
@@ -408,7 +420,8 @@ struct PointCloud {
         nextptidx = lastpos;
     }
     
-    size_t load_txt(const char* filename, std::vector<std::vector<FloatType> >* additionalInfo = 0, std::vector<size_t> *line_numbers = 0, int subsampling_factor = 0) {
+    // line_offsets, if given, receives the byte offset of each point line in the file
+    size_t load_txt(const char* filename, std::vector<std::vector<FloatType> >* additionalInfo = 0, std::vector<size_t> *line_numbers = 0, int subsampling_factor = 0, std::vector<size_t> *line_offsets = 0) {
         using namespace std;
         data.clear();
         grid.clear();
@@ -423,13 +436,17 @@ struct PointCloud {
         size_t linelen = 0;
         int num_read = 0;
         size_t linenum = 0;
+        size_t fileoffset = 0;
         boost::mt19937* rng = 0;
         if (subsampling_factor) rng = new boost::mt19937;
         while ((num_read = getline(&line, &linelen, fp)) != -1) {
             ++linenum;
+            size_t lineoffset = fileoffset;
+            fileoffset += num_read;
             if (linelen==0 || line[0]=='#') continue;
             if (subsampling_factor && ((*rng)()%subsampling_factor>0)) continue;
             if (line_numbers) line_numbers->push_back(linenum);
+            if (line_offsets) line_offsets->push_back(lineoffset);
             if (additionalInfo) additionalInfo->push_back(std::vector<FloatType>());
             PointType point;
             int i = 0;
@@ -454,8 +471,27 @@ struct PointCloud {
         for (size_t i = 0; i<data.size(); ++i) insert_data_at_index(i);
         return linenum;
     }
-    inline size_t load_txt(std::string s, std::vector<std::vector<FloatType> >* additionalInfo = 0, std::vector<size_t> *line_numbers = 0, int subsampling_factor = 0) {
-        return load_txt(s.c_str(), additionalInfo, line_numbers, subsampling_factor);
+    inline size_t load_txt(std::string s, std::vector<std::vector<FloatType> >* additionalInfo = 0, std::vector<size_t> *line_numbers = 0, int subsampling_factor = 0, std::vector<size_t> *line_offsets = 0) {
+        return load_txt(s.c_str(), additionalInfo, line_numbers, subsampling_factor, line_offsets);
+    }
+
+    // indexes the given points, as load_txt does with the points of a file
+    void load_points(const std::vector<PointType>& points) {
+        using namespace std;
+        data = points;
+        xmin = numeric_limits<FloatType>::max();
+        xmax = -numeric_limits<FloatType>::max();
+        ymin = numeric_limits<FloatType>::max();
+        ymax = -numeric_limits<FloatType>::max();
+        for (size_t i = 0; i<data.size(); ++i) {
+            xmin = min(xmin, data[i].x);
+            xmax = max(xmax, data[i].x);
+            ymin = min(ymin, data[i].y);
+            ymax = max(ymax, data[i].y);
+        }
+        prepare(xmin, xmax, ymin, ymax, data.size());
+        nextptidx = data.size();
+        for (size_t i = 0; i<data.size(); ++i) insert_data_at_index(i);
     }
 
     // TODO: save_bin / load_bin if txt files take too long to load
@@ -469,6 +505,67 @@ struct PointCloud {
         );
     }
     
+    // same as findNeighbors, but appends compact index records to the vector
+    template<class SomePointType>
+    void findNeighborIndices(std::vector<NeighborIndex>& neighbors, const SomePointType& center, FloatType radius) {
+        PointType* first = data.data();
+        applyToNeighbors(
+            [&neighbors, first](FloatType d2, PointType* p) {neighbors.push_back(NeighborIndex(d2, p - first));},
+            center,
+            radius
+        );
+    }
+
+    // gathers the coordinates of the first n neighbors, centered on avg, into the
+    // column-major n x 3 matrix A: all x, then all y, then all z (as LAPACK wants it)
+    template<typename T>
+    void gatherCentered(const NeighborIndex* neighbors, int n, const PointType& avg, T* A) const {
+        T* Ax = A; T* Ay = A + n; T* Az = A + 2*n;
+        for (int i=0; i<n; ++i) {
+            const PointType& p = data[neighbors[i].idx];
+            Ax[i] = p.x - avg.x;
+            Ay[i] = p.y - avg.y;
+            Az[i] = p.z - avg.z;
+        }
+    }
+
+    // deterministic, spatially stratified subsample of k among the n neighbors, all within
+    // radius of the center. The ball bounding box is cut in about k cells, neighbors are
+    // ordered by cell (keeping their order within a cell) and every n/k-th one is kept,
+    // so each cell receives a share of the sample proportional to its point count.
+    // scratch is caller-owned working space, reused from one call to the next.
+    template<class SomePointType>
+    void stratifiedSubsample(const NeighborIndex* neighbors, int n, const SomePointType& center, FloatType radius, int k, std::vector<NeighborIndex>& sample, std::vector<int>& scratch) const {
+        sample.clear();
+        if (n<=k) {
+            sample.assign(neighbors, neighbors+n);
+            return;
+        }
+        int g = (int)ceil(cbrt((double)k));
+        if (g<1) g = 1;
+        int ncells = g*g*g;
+        double cellinv = g / (2. * radius);
+        // cell of each neighbor, cell starts, then the neighbors sorted by cell
+        scratch.resize(n + ncells+1 + n);
+        int* cell = &scratch[0];
+        int* start = cell + n;
+        int* sorted = start + ncells+1;
+        std::fill(start, start + ncells+1, 0);
+        for (int i=0; i<n; ++i) {
+            const PointType& p = data[neighbors[i].idx];
+            int ix = std::max(0, std::min(g-1, (int)floor((p.x - center.x + radius) * cellinv)));
+            int iy = std::max(0, std::min(g-1, (int)floor((p.y - center.y + radius) * cellinv)));
+            int iz = std::max(0, std::min(g-1, (int)floor((p.z - center.z + radius) * cellinv)));
+            cell[i] = (iz * g + iy) * g + ix;
+            ++start[cell[i]+1];
+        }
+        // counting sort by cell
+        for (int c=0; c<ncells; ++c) start[c+1] += start[c];
+        for (int i=0; i<n; ++i) sorted[start[cell[i]]++] = i;
+        sample.resize(k);
+        for (int j=0; j<k; ++j) sample[j] = neighbors[sorted[(int)(((long long)j * 2 + 1) * n / (2LL * k))]];
+    }
+
     template<typename FunctorType, class SomePointType>
     void applyToNeighbors(FunctorType functor, const SomePointType& center, FloatType radius) {
         int cx1 = floor((center.x - radius - xmin) / cellside);
@@ -488,97 +585,108 @@ struct PointCloud {
         }
     }
 
-    // returns the index of the nearest point in the cloud from the point given in argument
-    // The center point may be excluded from the search or included
-    // The exclusion squared distance fixes the threshold at which points are considered the same
-    // set it to 0 to include the search point (default)
-    // returns -1 iff the cloud is empty
+    // the k nearest points to the center, by increasing distance, into result
+    // Points closer than the exclusion squared distance are ignored, set it to 0 to include
+    // the search point (default). Returns the number of points found: k unless the cloud is smaller
+    // The search is exact: rings of cells are visited around the center cell until the
+    // closest possible point in the next ring is farther than the current k-th neighbor.
     template<class SomePointType>
-    int findNearest(const SomePointType& center, FloatType exclusionDistSq = 0) {
-        int cx = floor((center.x - xmin) / cellside);
-        int cy = floor((center.y - ymin) / cellside);
-        // look for a non-empty cell in increasing distance. Once it is found, the nearest neighbor is necessarily within that radius
-        int found_dcell = -1;
-        for (int dcell = 0; dcell<std::max(ncellx,ncelly); ++dcell) {
-            // loop only in the square at dcell distance from the center cell
-            for (int cxi = cx-dcell; cxi <= cx + dcell; ++cxi) {
-                // top
-                if (cxi>=0 && cxi<ncellx && cy-dcell>=0 && cy-dcell<ncelly && grid[(cy-dcell) * ncellx + cxi]!=IndexType(-1)) {
-                    bool otherThanCenter = false;
-                    for (IndexType pidx = grid[(cy-dcell) * ncellx + cxi]; pidx != IndexType(-1); pidx=links[pidx]) if (dist2(center,data[pidx])>=exclusionDistSq) {
-                        otherThanCenter = true;
-                        break;
-                    }
-                    if (otherThanCenter) {found_dcell = dcell; break;}
-                }
-                // bottom
-                if (cxi>=0 && cxi<ncellx && cy+dcell>=0 && cy+dcell<ncelly && grid[(cy+dcell) * ncellx + cxi]!=IndexType(-1)) {
-                    bool otherThanCenter = false;
-                    for (IndexType pidx = grid[(cy+dcell) * ncellx + cxi]; pidx != IndexType(-1); pidx=links[pidx]) if (dist2(center,data[pidx])>=exclusionDistSq) {
-                        otherThanCenter = true;
-                        break;
-                    }
-                    if (otherThanCenter) {found_dcell = dcell; break;}
+    int findNearestNeighbors(const SomePointType& center, int k, NeighborIndex* result, FloatType exclusionDistSq = 0) const {
+        if (k<=0 || grid.empty()) return 0;
+        FloatType fx = (center.x - xmin) / cellside;
+        FloatType fy = (center.y - ymin) / cellside;
+        int cx = floor(fx);
+        int cy = floor(fy);
+        // position within the center cell
+        fx -= cx; fy -= cy;
+        // result is a max-heap on the distance during the search
+        int nfound = 0;
+        auto visit = [&](int x, int y) {
+            for (IndexType p = grid[y * ncellx + x]; p!=IndexType(-1); p=links[p]) {
+                FloatType d2 = dist2(center,data[p]);
+                if (d2<exclusionDistSq) continue;
+                if (nfound<k) {
+                    result[nfound++] = NeighborIndex(d2,p);
+                    std::push_heap(result, result+nfound);
+                } else if (d2<result[0].distsq) {
+                    std::pop_heap(result, result+k);
+                    result[k-1] = NeighborIndex(d2,p);
+                    std::push_heap(result, result+k);
                 }
             }
-            if (found_dcell!=-1) break;
-            // left and right, omitting the corners
-            for (int cyi = cy-dcell+1; cyi <= cy + dcell - 1; ++cyi) {
-                // left
-                if (cx-dcell>=0 && cx-dcell<ncellx && cyi>=0 && cyi<ncelly && grid[cyi * ncellx + cx - dcell]!=IndexType(-1)) {
-                    bool otherThanCenter = false;
-                    for (IndexType pidx = grid[cyi * ncellx + cx - dcell]; pidx != IndexType(-1); pidx=links[pidx]) if (dist2(center,data[pidx])>=exclusionDistSq) {
-                        otherThanCenter = true;
-                        break;
-                    }
-                    if (otherThanCenter) {found_dcell = dcell; break;}
-                }
-                // right
-                if (cx+dcell>=0 && cx+dcell<ncellx && cyi>=0 && cyi<ncelly && grid[cyi * ncellx + cx + dcell]!=IndexType(-1)) {
-                    bool otherThanCenter = false;
-                    for (IndexType pidx = grid[cyi * ncellx + cx + dcell]; pidx != IndexType(-1); pidx=links[pidx]) if (dist2(center,data[pidx])>=exclusionDistSq) {
-                        otherThanCenter = true;
-                        break;
-                    }
-                    if (otherThanCenter) {found_dcell = dcell; break;}
+        };
+        for (int r = 0;; ++r) {
+            int cx1 = cx - r, cx2 = cx + r;
+            int cy1 = cy - r, cy2 = cy + r;
+            // all cells of that ring are outside the grid, and so are the next rings
+            if (cx1<0 && cx2>=ncellx && cy1<0 && cy2>=ncelly) break;
+            if (r>0 && nfound==k) {
+                FloatType lowerbound = std::min(std::min(r-1+fx, r-fx), std::min(r-1+fy, r-fy)) * cellside;
+                if (lowerbound * lowerbound > result[0].distsq) break;
+            }
+            for (int y = std::max(cy1,0); y <= std::min(cy2,ncelly-1); ++y) {
+                if (y==cy1 || y==cy2) {
+                    for (int x = std::max(cx1,0); x <= std::min(cx2,ncellx-1); ++x) visit(x,y);
+                } else {
+                    if (cx1>=0 && cx1<ncellx) visit(cx1,y);
+                    if (cx2>=0 && cx2<ncellx) visit(cx2,y);
                 }
             }
-            if (found_dcell!=-1) break;
         }
-        if (found_dcell==-1) {
-#ifndef NDEBUG
-            std::cerr << "Could not find dcell: cx=" << cx << ", cy=" << cy << ", ncellx=" << ncellx << ", ncelly=" << ncelly << ", center.x=" << center.x << ", center.y=" << center.y << ", xmin=" << xmin << ", xmax=" << xmax << ", ymin=" << ymin << ", ymax=" << ymax << std::endl;
-#endif
-            return -1;
+        std::sort_heap(result, result+nfound);
+        return nfound;
+    }
+
+    // batched k nearest neighbors: k indices and squared distances per query, padded with -1
+    // and max() if the cloud is smaller. The queries are processed in parallel, in the order
+    // of their grid cell, so that consecutive searches visit the same cells.
+    template<class SomePointType>
+    void findNearestNeighbors(const SomePointType* queries, int nqueries, int k, int* indices, FloatType* distsq = 0, FloatType exclusionDistSq = 0) const {
+        if (k<=0 || nqueries<=0) return;
+        // no cell to sort the queries into, every result is padding
+        if (data.empty() || grid.empty()) {
+            std::fill(indices, indices + (long)nqueries*k, -1);
+            if (distsq) std::fill(distsq, distsq + (long)nqueries*k, std::numeric_limits<FloatType>::max());
+            return;
         }
-        // neighbor necessarily within dcell+1 distance, limit case if we are very close to a cell edge
-        IndexType idx = IndexType(-1);
-        int cx1 = cx - found_dcell;
-        int cx2 = cx + found_dcell;
-        int cy1 = cy - found_dcell;
-        int cy2 = cy + found_dcell;
-        if (cx1<0) cx1=0;
-        if (cx2>=ncellx) cx2=ncellx-1;
-        if (cy1<0) cy1=0;
-        if (cy2>=ncelly) cy2=ncelly-1;
-        FloatType mind2 = std::numeric_limits<FloatType>::max();
-        for (int cy = cy1; cy <= cy2; ++cy) for (int cx = cx1; cx <= cx2; ++cx) {
-            for (IndexType p = grid[cy * ncellx + cx]; p!=IndexType(-1); p=links[p]) {
-                FloatType d2 = dist2(center,data[p]);
-                if (d2<exclusionDistSq) continue;
-                if (d2<=mind2) {
-                    mind2 = d2;
-                    idx = p;
+        // counting sort of the queries by cell, out of grid queries in the nearest border cell
+        int ncells = ncellx * ncelly;
+        std::vector<int> cellstart(ncells+1, 0);
+        std::vector<int> querycell(nqueries);
+        for (int qi=0; qi<nqueries; ++qi) {
+            int cx = std::min(std::max((int)floor((queries[qi].x - xmin) / cellside), 0), ncellx-1);
+            int cy = std::min(std::max((int)floor((queries[qi].y - ymin) / cellside), 0), ncelly-1);
+            querycell[qi] = cy * ncellx + cx;
+            ++cellstart[querycell[qi]+1];
+        }
+        for (int c=0; c<ncells; ++c) cellstart[c+1] += cellstart[c];
+        std::vector<int> order(nqueries);
+        for (int qi=0; qi<nqueries; ++qi) order[cellstart[querycell[qi]]++] = qi;
+#pragma omp parallel
+        {
+            std::vector<NeighborIndex> knn(k);
+#pragma omp for schedule(dynamic,256)
+            for (int oi=0; oi<nqueries; ++oi) {
+                int qi = order[oi];
+                int nfound = findNearestNeighbors(queries[qi], k, &knn[0], exclusionDistSq);
+                for (int i=0; i<k; ++i) {
+                    indices[(long)qi*k+i] = i<nfound ? (int)knn[i].idx : -1;
+                    if (distsq) distsq[(long)qi*k+i] = i<nfound ? knn[i].distsq : std::numeric_limits<FloatType>::max();
                 }
             }
         }
-        if (idx==IndexType(-1)) {
-#ifndef NDEBUG
-            std::cerr << "Could not find index: found_dcell=" << found_dcell << ", cx=" << cx << ", cy=" << cy << ", ncellx=" << ncellx << ", ncelly=" << ncelly << ", center.x=" << center.x << ", center.y=" << center.y << ", xmin=" << xmin << ", xmax=" << xmax << ", ymin=" << ymin << ", ymax=" << ymax << std::endl;
-#endif
-            return -1;
-        }
-        return idx;
+    }
+
+    // returns the index of the nearest point in the cloud from the point given in argument
+    // The center point may be excluded from the search or included
+    // The exclusion squared distance fixes the threshold at which points are considered the same
+    // set it to 0 to include the search point (default)
+    // returns -1 iff the cloud is empty
+    template<class SomePointType>
+    int findNearest(const SomePointType& center, FloatType exclusionDistSq = 0) const {
+        NeighborIndex nearest;
+        if (findNearestNeighbors(center, 1, &nearest, exclusionDistSq)==0) return -1;
+        return nearest.idx;
     }
 
 };
@@ -0,0 +1,258 @@
+//**********************************************************************
+//* This file is a part of the CANUPO project, a set of programs for   *
+//* classifying automatically 3D point clouds according to the local   *
+//* multi-scale dimensionality at each point.                          *
+//*                                                                    *
+//* Author & Copyright: Nicolas Brodu <nicolas.brodu@numerimoire.net>  *
+//*                                                                    *
+//* This project is free software; you can redistribute it and/or      *
+//* modify it under the terms of the GNU Lesser General Public         *
+//* License as published by the Free Software Foundation; either       *
+//* version 2.1 of the License, or (at your option) any later version. *
+//*                                                                    *
+//* This library is distributed in the hope that it will be useful,    *
+//* but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+//* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU  *
+//* Lesser General Public License for more details.                    *
+//*                                                                    *
+//* You should have received a copy of the GNU Lesser General Public   *
+//* License along with this library; if not, write to the Free         *
+//* Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,    *
+//* MA  02110-1301  USA                                                *
+//*                                                                    *
+//**********************************************************************/
+#ifndef CANUPO_PYRAMID_HPP
+#define CANUPO_PYRAMID_HPP
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include "points.hpp"
+
+/*
+Multi-resolution moment pyramid, for covariances over very large neighborhoods.
+
+Points are sorted along a 3D Morton curve of voxels of side h0, so every voxel at
+every level (side h0 * 2^level) is a contiguous range of the sorted points. Each
+non-empty voxel stores its point count, mean and central second moments. Children
+of a voxel are contiguous in the finer level, so a query descends from the root:
+- voxels entirely within the sphere are added as a whole (parallel-axis theorem)
+- voxels entirely outside are skipped
+- voxels straddling the boundary are refined, down to the exact points
+The tolerance allows straddling voxels of side <= tolerance * radius to be taken
+as a whole (or not at all) depending on whether their mean is in the sphere,
+which bounds the error to a shell of relative thickness ~tolerance. With 0 the
+result is exact (up to rounding) but still avoids scanning the interior points.
+*/
+
+// 21 bits per coordinate, interleaved as x | y<<1 | z<<2
+inline uint64_t morton_spread3(uint32_t v) {
+    uint64_t x = v & 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+}
+inline uint32_t morton_compact3(uint64_t x) {
+    x &= 0x1249249249249249ULL;
+    x = (x ^ (x >> 2)) & 0x10c30c30c30c30c3ULL;
+    x = (x ^ (x >> 4)) & 0x100f00f00f00f00fULL;
+    x = (x ^ (x >> 8)) & 0x1f0000ff0000ffULL;
+    x = (x ^ (x >> 16)) & 0x1f00000000ffffULL;
+    x = (x ^ (x >> 32)) & 0x1fffffULL;
+    return (uint32_t)x;
+}
+
+// moments accumulated relative to the query center, which keeps them well conditioned
+struct MomentSum {
+    double count;
+    double sum[3];
+    double sumsq[6]; // xx xy xz yy yz zz
+    MomentSum() : count(0) {
+        for (int i=0; i<3; ++i) sum[i] = 0;
+        for (int i=0; i<6; ++i) sumsq[i] = 0;
+    }
+    inline void add(double dx, double dy, double dz) {
+        count += 1;
+        sum[0] += dx; sum[1] += dy; sum[2] += dz;
+        sumsq[0] += dx*dx; sumsq[1] += dx*dy; sumsq[2] += dx*dz;
+        sumsq[3] += dy*dy; sumsq[4] += dy*dz; sumsq[5] += dz*dz;
+    }
+    // n points of mean at (dx,dy,dz) from the center, with central moments m2
+    inline void add(double n, double dx, double dy, double dz, const double* m2) {
+        count += n;
+        sum[0] += n*dx; sum[1] += n*dy; sum[2] += n*dz;
+        sumsq[0] += m2[0] + n*dx*dx; sumsq[1] += m2[1] + n*dx*dy; sumsq[2] += m2[2] + n*dx*dz;
+        sumsq[3] += m2[3] + n*dy*dy; sumsq[4] += m2[4] + n*dy*dz; sumsq[5] += m2[5] + n*dz*dz;
+    }
+    // scatter matrix around the mean, 3x3 column-major (full)
+    void scatter(double* S) const {
+        double m[3] = {sum[0]/count, sum[1]/count, sum[2]/count};
+        S[0] = sumsq[0] - count*m[0]*m[0];
+        S[1] = S[3] = sumsq[1] - count*m[0]*m[1];
+        S[2] = S[6] = sumsq[2] - count*m[0]*m[2];
+        S[4] = sumsq[3] - count*m[1]*m[1];
+        S[5] = S[7] = sumsq[4] - count*m[1]*m[2];
+        S[8] = sumsq[5] - count*m[2]*m[2];
+    }
+};
+
+template<class PointType>
+struct MomentPyramid {
+
+    struct Node {
+        uint64_t key;                // Morton code of the voxel at its level
+        IndexType begin, end;        // range in the sorted points
+        IndexType firstchild, endchild; // range in the finer level
+        double mean[3];
+        double m2[6];                // central second moments xx xy xz yy yz zz
+    };
+
+    std::vector<PointType> pts;      // points sorted by Morton code
+    std::vector<std::vector<Node> > levels; // levels[0] is the finest
+    double xmin, ymin, zmin;
+    double h0;
+
+    // voxelside: side of the finest voxels, a few points per voxel is good
+    void build(const std::vector<PointType>& data, double voxelside) {
+        using namespace std;
+        levels.clear();
+        pts.clear();
+        if (data.empty()) return;
+        xmin = ymin = zmin = numeric_limits<double>::max();
+        double xmax, ymax, zmax;
+        xmax = ymax = zmax = -numeric_limits<double>::max();
+        for (size_t i=0; i<data.size(); ++i) {
+            xmin = min(xmin, (double)data[i].x); xmax = max(xmax, (double)data[i].x);
+            ymin = min(ymin, (double)data[i].y); ymax = max(ymax, (double)data[i].y);
+            zmin = min(zmin, (double)data[i].z); zmax = max(zmax, (double)data[i].z);
+        }
+        // 21 bits per coordinate
+        double extent = max(xmax-xmin, max(ymax-ymin, zmax-zmin));
+        h0 = max(voxelside, extent / 0x1ffffe);
+        if (h0<=0) h0 = 1;
+
+        vector<pair<uint64_t,IndexType> > codes(data.size());
+        for (size_t i=0; i<data.size(); ++i) codes[i] = make_pair(code(data[i]), (IndexType)i);
+        sort(codes.begin(), codes.end());
+        pts.resize(data.size());
+        for (size_t i=0; i<data.size(); ++i) pts[i] = data[codes[i].second];
+
+        // finest level, moments computed from the points
+        levels.push_back(vector<Node>());
+        for (size_t begin = 0; begin < codes.size();) {
+            size_t end = begin + 1;
+            while (end < codes.size() && codes[end].first == codes[begin].first) ++end;
+            Node node;
+            node.key = codes[begin].first;
+            node.begin = begin; node.end = end;
+            node.firstchild = node.endchild = 0;
+            double n = end - begin;
+            for (int j=0; j<3; ++j) node.mean[j] = 0;
+            for (size_t i=begin; i<end; ++i) {
+                node.mean[0] += pts[i].x; node.mean[1] += pts[i].y; node.mean[2] += pts[i].z;
+            }
+            for (int j=0; j<3; ++j) node.mean[j] /= n;
+            for (int j=0; j<6; ++j) node.m2[j] = 0;
+            for (size_t i=begin; i<end; ++i) {
+                double dx = pts[i].x - node.mean[0], dy = pts[i].y - node.mean[1], dz = pts[i].z - node.mean[2];
+                node.m2[0] += dx*dx; node.m2[1] += dx*dy; node.m2[2] += dx*dz;
+                node.m2[3] += dy*dy; node.m2[4] += dy*dz; node.m2[5] += dz*dz;
+            }
+            levels[0].push_back(node);
+            begin = end;
+        }
+
+        // coarser levels, combining the children moments
+        while (levels.back().size() > 1) {
+            const vector<Node>& fine = levels.back();
+            vector<Node> coarse;
+            for (size_t c = 0; c < fine.size();) {
+                size_t cend = c + 1;
+                uint64_t key = fine[c].key >> 3;
+                while (cend < fine.size() && (fine[cend].key >> 3) == key) ++cend;
+                Node node;
+                node.key = key;
+                node.begin = fine[c].begin; node.end = fine[cend-1].end;
+                node.firstchild = c; node.endchild = cend;
+                double n = node.end - node.begin;
+                for (int j=0; j<3; ++j) {
+                    node.mean[j] = 0;
+                    for (size_t i=c; i<cend; ++i) node.mean[j] += (fine[i].end - fine[i].begin) * fine[i].mean[j];
+                    node.mean[j] /= n;
+                }
+                for (int j=0; j<6; ++j) node.m2[j] = 0;
+                for (size_t i=c; i<cend; ++i) {
+                    double ni = fine[i].end - fine[i].begin;
+                    double dx = fine[i].mean[0] - node.mean[0], dy = fine[i].mean[1] - node.mean[1], dz = fine[i].mean[2] - node.mean[2];
+                    node.m2[0] += fine[i].m2[0] + ni*dx*dx; node.m2[1] += fine[i].m2[1] + ni*dx*dy;
+                    node.m2[2] += fine[i].m2[2] + ni*dx*dz; node.m2[3] += fine[i].m2[3] + ni*dy*dy;
+                    node.m2[4] += fine[i].m2[4] + ni*dy*dz; node.m2[5] += fine[i].m2[5] + ni*dz*dz;
+                }
+                coarse.push_back(node);
+                c = cend;
+            }
+            levels.push_back(coarse);
+        }
+    }
+
+    // accumulates the moments of all points within radius of the center
+    template<class SomePointType>
+    MomentSum query(const SomePointType& center, FloatType radius, FloatType tolerance = 0) const {
+        MomentSum acc;
+        if (levels.empty()) return acc;
+        int top = levels.size() - 1;
+        for (size_t i=0; i<levels[top].size(); ++i) descend(acc, top, i, center, (double)radius * radius, tolerance * radius);
+        return acc;
+    }
+
+    template<class SomePointType>
+    void descend(MomentSum& acc, int level, size_t nodeidx, const SomePointType& center, double r2, double minside) const {
+        const Node& node = levels[level][nodeidx];
+        double side = h0 * (double)(uint64_t(1) << level);
+        double c[3] = {center.x, center.y, center.z};
+        double lo[3] = {
+            xmin + morton_compact3(node.key) * side,
+            ymin + morton_compact3(node.key >> 1) * side,
+            zmin + morton_compact3(node.key >> 2) * side
+        };
+        double dmin2 = 0, dmax2 = 0;
+        for (int j=0; j<3; ++j) {
+            double dlo = c[j] - lo[j], dhi = lo[j] + side - c[j];
+            if (dlo<0) dmin2 += dlo*dlo;
+            else if (dhi<0) dmin2 += dhi*dhi;
+            double dfar = std::max(fabs(dlo), fabs(dhi));
+            dmax2 += dfar*dfar;
+        }
+        if (dmin2 > r2) return;
+        if (dmax2 <= r2) {
+            acc.add(node.end - node.begin, node.mean[0]-c[0], node.mean[1]-c[1], node.mean[2]-c[2], node.m2);
+            return;
+        }
+        if (level==0) {
+            for (IndexType i = node.begin; i < node.end; ++i) {
+                if (dist2(center, pts[i]) <= r2) acc.add(pts[i].x - c[0], pts[i].y - c[1], pts[i].z - c[2]);
+            }
+            return;
+        }
+        // small enough boundary voxel: take it as a whole, or not at all
+        if (side <= minside) {
+            double dx = node.mean[0]-c[0], dy = node.mean[1]-c[1], dz = node.mean[2]-c[2];
+            if (dx*dx+dy*dy+dz*dz <= r2) acc.add(node.end - node.begin, dx, dy, dz, node.m2);
+            return;
+        }
+        for (IndexType i = node.firstchild; i < node.endchild; ++i) descend(acc, level-1, i, center, r2, minside);
+    }
+
+    inline uint64_t code(const PointType& p) const {
+        uint32_t ix = (uint32_t)floor((p.x - xmin) / h0);
+        uint32_t iy = (uint32_t)floor((p.y - ymin) / h0);
+        uint32_t iz = (uint32_t)floor((p.z - zmin) / h0);
+        return morton_spread3(ix) | (morton_spread3(iy) << 1) | (morton_spread3(iz) << 2);
+    }
+};
+
+#endif
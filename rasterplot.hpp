@@ -0,0 +1,111 @@
+//**********************************************************************
+//* This file is a part of the CANUPO project, a set of programs for   *
+//* classifying automatically 3D point clouds according to the local   *
+//* multi-scale dimensionality at each point.                          *
+//*                                                                    *
+//* Author & Copyright: Nicolas Brodu <nicolas.brodu@numerimoire.net>  *
+//*                                                                    *
+//* This project is free software; you can redistribute it and/or      *
+//* modify it under the terms of the GNU Lesser General Public         *
+//* License as published by the Free Software Foundation; either       *
+//* version 2.1 of the License, or (at your option) any later version. *
+//*                                                                    *
+//* This library is distributed in the hope that it will be useful,    *
+//* but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+//* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU  *
+//* Lesser General Public License for more details.                    *
+//*                                                                    *
+//* You should have received a copy of the GNU Lesser General Public   *
+//* License along with this library; if not, write to the Free         *
+//* Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,    *
+//* MA  02110-1301  USA                                                *
+//*                                                                    *
+//**********************************************************************/
+#ifndef CANUPO_RASTERPLOT_HPP
+#define CANUPO_RASTERPLOT_HPP
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+#include "png++/png.hpp"
+#include "base64.hpp"
+
+/*
+Direct raster output for the plots, without going through a vector format:
+the pixels are set in memory and written as a PNG. When the plot needs to be
+edited afterwards, the PNG can be embedded in a minimal SVG file.
+*/
+
+struct RasterImage {
+    int width, height;
+    std::vector<unsigned char> rgb;
+
+    RasterImage(int _width = 0, int _height = 0) {resize(_width, _height);}
+
+    // all white
+    void resize(int _width, int _height) {
+        width = _width; height = _height;
+        rgb.assign(width * height * 3, 255);
+    }
+
+    inline void set(int x, int y, int r, int g, int b) {
+        unsigned char* p = &rgb[(y * width + x) * 3];
+        p[0] = r; p[1] = g; p[2] = b;
+    }
+
+    // copies another image at the given position, clipped to this one
+    void blit(const RasterImage& img, int x0, int y0) {
+        int xbegin = std::max(0, -x0), xend = std::min(img.width, width - x0);
+        int ybegin = std::max(0, -y0), yend = std::min(img.height, height - y0);
+        if (xbegin >= xend) return;
+        for (int y = ybegin; y < yend; ++y) {
+            memcpy(&rgb[((y0 + y) * width + x0 + xbegin) * 3], &img.rgb[(y * img.width + xbegin) * 3], (xend - xbegin) * 3);
+        }
+    }
+};
+
+// png++ output stream appending to a memory buffer
+struct PngMemorySink {
+    std::vector<char>& data;
+    PngMemorySink(std::vector<char>& _data) : data(_data) {}
+    void write(char const* c, size_t s) {data.insert(data.end(), c, c + s);}
+    void flush() {}
+    bool good() {return true;}
+};
+
+inline void encode_png(const RasterImage& img, std::vector<char>& pngdata) {
+    png::image<png::rgb_pixel> image(img.width, img.height);
+    for (int y = 0; y < img.height; ++y) {
+        const unsigned char* p = &img.rgb[y * img.width * 3];
+        for (int x = 0; x < img.width; ++x, p += 3) image[y][x] = png::rgb_pixel(p[0], p[1], p[2]);
+    }
+    pngdata.clear();
+    PngMemorySink sink(pngdata);
+    image.write_stream(sink);
+}
+
+inline void write_png(const RasterImage& img, const char* filename) {
+    std::vector<char> pngdata;
+    encode_png(img, pngdata);
+    std::ofstream pngfile(filename, std::ofstream::binary);
+    pngfile.write(&pngdata[0], pngdata.size());
+}
+
+// minimal SVG file with the image embedded, for editing in a vector drawing program
+inline void write_svg_png(const RasterImage& img, const char* filename) {
+    std::vector<char> pngdata;
+    encode_png(img, pngdata);
+    base64 codec;
+    std::vector<char> base64pngdata(codec.get_max_encoded_size(pngdata.size()));
+    int nbytes = codec.encode(&pngdata[0], pngdata.size(), &base64pngdata[0]);
+    nbytes += codec.encode_end(&base64pngdata[nbytes]);
+    std::ofstream svgfile(filename);
+    svgfile << "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\""<< img.width << "\" height=\""<< img.height <<"\" >" << std::endl;
+    svgfile << "<image xlink:href=\"data:image/png;base64,";
+    svgfile.write(&base64pngdata[0], nbytes);
+    svgfile << "\" width=\""<<img.width<<"\" height=\""<<img.height<<"\" x=\"0\" y=\"0\" />" << std::endl;
+    svgfile << "</svg>" << std::endl;
+}
+
+#endif
@@ -24,6 +24,7 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <map>
 
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/variate_generator.hpp>
@@ -32,7 +33,10 @@
 
 #include <boost/format.hpp>
 
+#include <string.h>
+
 #include "points.hpp"
+#include "chunkio.hpp"
 using namespace std;
 using namespace boost;
 
@@ -50,6 +54,13 @@ resample cloud.xyz result.xyz flag parameter [opt_param]\n\
                             # two points for the spatial mode.\n\
   input: opt_param          # minimum distance between two points when both\n\
                             # \"r\" and \"s\" are specified.\n\
+resample cloud.xyz result.xyz n count\n\
+                            # Retains exactly count lines chosen at random (or all\n\
+                            # lines if there are fewer).\n\
+resample cloud.xyz result.xyz t count tile_side\n\
+                            # Stratified sampling: the (x,y) plane is cut in square\n\
+                            # tiles of the given side, and count lines are chosen\n\
+                            # at random in each tile (or all lines if there are fewer).\n\
 "<<endl;
     if (errmsg) cout << "Error: " << errmsg << endl;
     return 0;
@@ -60,10 +71,117 @@ struct Index {
 };
 typedef PointTemplate<Index> PointIdx;
 
+// random key attached to each line, from its offset, so the choice does not depend on the chunks
+inline uint64_t line_key(uint64_t seed, uint64_t offset) {
+    // splitmix64 finalizer
+    uint64_t z = seed + offset * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+typedef pair<uint64_t, size_t> KeyedLine;
+
+// keeps the count lines of smallest keys in a max-heap
+inline void keep_smallest(vector<KeyedLine>& heap, const KeyedLine& kl, int count) {
+    if ((int)heap.size()<count) {
+        heap.push_back(kl);
+        push_heap(heap.begin(), heap.end());
+    } else if (kl < heap[0]) {
+        pop_heap(heap.begin(), heap.end());
+        heap.back() = kl;
+        push_heap(heap.begin(), heap.end());
+    }
+}
+
+// exact count (tile_side<=0) or per tile sampling, without loading the cloud
+// Each line gets a random key and the lines of smallest keys are retained, per tile
+// if needed. The file is cut in chunks processed in parallel, and the per-chunk
+// selections are then merged.
+int sample_count(const char* infile, ostream& resultfile, int count, FloatType tile_side, uint64_t seed) {
+    MappedTextFile input(infile);
+    cout << "Sampling data cloud: " << infile << endl;
+    vector<size_t> chunkbegin;
+    input.split(1<<24, chunkbegin);
+    int nchunks = chunkbegin.size() - 1;
+    bool tiled = tile_side>0;
+    vector<vector<KeyedLine> > chunkselection(nchunks);
+    vector<map<pair<int,int>, vector<KeyedLine> > > chunktiles(nchunks);
+    vector<size_t> chunknlines(nchunks, 0);
+#pragma omp parallel for schedule(dynamic,1)
+    for (int c=0; c<nchunks; ++c) {
+        char buf[256];
+        for (size_t offset = chunkbegin[c]; offset < chunkbegin[c+1];) {
+            size_t end = input.line_end(offset);
+            if (input.data[offset]=='#') {offset = end; continue;}
+            ++chunknlines[c];
+            KeyedLine kl(line_key(seed, offset), offset);
+            if (!tiled) keep_smallest(chunkselection[c], kl, count);
+            else {
+                // the line may not be 0-terminated, parse a copy of its beginning
+                size_t len = min(end - offset, sizeof(buf)-1);
+                memcpy(buf, input.data + offset, len);
+                buf[len] = 0;
+                char* x = buf;
+                FloatType px = fast_atof_next_token(x);
+                FloatType py = fast_atof_next_token(x);
+                pair<int,int> tile((int)floor(px / tile_side), (int)floor(py / tile_side));
+                keep_smallest(chunktiles[c][tile], kl, count);
+            }
+            offset = end;
+        }
+    }
+    // merge the chunk selections
+    size_t nlines = 0;
+    for (int c=0; c<nchunks; ++c) nlines += chunknlines[c];
+    vector<size_t> retained_lines;
+    if (!tiled) {
+        vector<KeyedLine> selection;
+        for (int c=0; c<nchunks; ++c) selection.insert(selection.end(), chunkselection[c].begin(), chunkselection[c].end());
+        if ((int)selection.size()>count) {
+            nth_element(selection.begin(), selection.begin()+count, selection.end());
+            selection.resize(count);
+        }
+        for (size_t i=0; i<selection.size(); ++i) retained_lines.push_back(selection[i].second);
+    } else {
+        map<pair<int,int>, vector<KeyedLine> > tiles;
+        for (int c=0; c<nchunks; ++c) {
+            for (map<pair<int,int>, vector<KeyedLine> >::iterator it = chunktiles[c].begin(); it != chunktiles[c].end(); ++it) {
+                vector<KeyedLine>& tile = tiles[it->first];
+                for (size_t i=0; i<it->second.size(); ++i) keep_smallest(tile, it->second[i], count);
+            }
+            chunktiles[c].clear();
+        }
+        for (map<pair<int,int>, vector<KeyedLine> >::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+            for (size_t i=0; i<it->second.size(); ++i) retained_lines.push_back(it->second[i].second);
+        }
+        cout << tiles.size() << " tiles" << endl;
+    }
+    sort(retained_lines.begin(), retained_lines.end());
+    cout << "Writing output file" << endl;
+    write_lines(resultfile, input, retained_lines);
+    cout << "Retained " << retained_lines.size() << " lines out of " << nlines << endl;
+    return 0;
+}
+
 int main(int argc, char** argv) {
 
     if (argc<5) return help();
 
+    if (!strcmp(argv[3],"n") || !strcmp(argv[3],"t")) {
+        int count = atoi(argv[4]);
+        if (count<=0) return help("invalid number of points");
+        FloatType tile_side = 0;
+        if (argv[3][0]=='t') {
+            if (argc<6) return help("missing tile side");
+            tile_side = atof(argv[5]);
+            if (tile_side<=0) return help("invalid tile side");
+        }
+        ofstream resultfile(argv[2], ofstream::binary);
+        boost::mt19937 rng;
+        return sample_count(argv[1], resultfile, count, tile_side, rng());
+    }
+
     bool random_mode = false, spatial_mode = false;
     if (strstr(argv[3],"r")!=0) random_mode = true;
     if (strstr(argv[3],"s")!=0) spatial_mode = true;
@@ -111,71 +229,119 @@ int main(int argc, char** argv) {
     // spatial subsampling mode - harder
     // reload with parsing and spatial indexation
     PointCloud<PointIdx> cloud;
-    vector<size_t> *line_numbers = new vector<size_t>();
+    // byte offset of each point line, so the retained lines are copied without parsing the file again
+    vector<size_t> line_offsets;
     cout << "Loading data cloud: " << argv[1] << endl;
-    size_t original_number_of_lines = cloud.load_txt(argv[1],0,line_numbers,subsampling_factor);
-    // make the link data set and line numbers
-    for (int i=0; i<cloud.data.size(); ++i) cloud.data[i].idx = (*line_numbers)[i];
-    // free redundant memory
-    delete line_numbers;
-
-    // algo: select a point at random.
-    //       output the corresponding line
-    //       remove all neighbors in the given radius (including itself)
-    //       until no point remains
+    size_t original_number_of_lines = cloud.load_txt(argv[1],0,0,subsampling_factor,&line_offsets);
+    // link the data set and the line offsets
+    for (int i=0; i<cloud.data.size(); ++i) cloud.data[i].idx = i;
+
+    // algo: Poisson-disk sampling, processed in parallel over a voxel grid
+    //       with cells of the minimum distance side, so only adjacent cells may
+    //       hold points closer than that distance.
+    //       The cells are colored in 27 phases by their coordinates modulo 3. Cells of
+    //       the same color are never adjacent and are processed concurrently.
+    //       Within a cell, points are visited in a random order and retained iff no
+    //       retained point in that cell or the adjacent ones is within the minimum distance.
+    //       The random order only depends on the seed and the cell, so the result does not
+    //       depend on the number of threads.
     cout << "Processing spatial resampling." << endl;
+    size_t npts = cloud.data.size();
+    FloatType zmin = numeric_limits<FloatType>::max();
+    FloatType zmax = -numeric_limits<FloatType>::max();
+    for (size_t i=0; i<npts; ++i) {
+        zmin = min(zmin, cloud.data[i].z);
+        zmax = max(zmax, cloud.data[i].z);
+    }
+    long nvx = (long)floor((cloud.xmax - cloud.xmin) / minimum_distance) + 1;
+    long nvy = (long)floor((cloud.ymax - cloud.ymin) / minimum_distance) + 1;
+    long nvz = (long)floor((zmax - zmin) / minimum_distance) + 1;
+    if (npts>0 && (double)nvx * (double)nvy * (double)nvz > 9e18) return help("minimum distance too small for the cloud extent");
+    // points sorted by voxel
+    vector<pair<long,int> > voxelpts(npts);
+    for (size_t i=0; i<npts; ++i) {
+        long vx = min(nvx-1, (long)floor((cloud.data[i].x - cloud.xmin) / minimum_distance));
+        long vy = min(nvy-1, (long)floor((cloud.data[i].y - cloud.ymin) / minimum_distance));
+        long vz = min(nvz-1, (long)floor((cloud.data[i].z - zmin) / minimum_distance));
+        voxelpts[i] = make_pair((vx * nvy + vy) * nvz + vz, (int)i);
+    }
+    sort(voxelpts.begin(), voxelpts.end());
+    vector<long> voxelkeys;
+    vector<int> voxelbegin;
+    for (size_t i=0; i<npts; ++i) if (i==0 || voxelpts[i].first!=voxelpts[i-1].first) {
+        voxelkeys.push_back(voxelpts[i].first);
+        voxelbegin.push_back(i);
+    }
+    int nvoxels = voxelkeys.size();
+    voxelbegin.push_back(npts);
+    vector<int> ptorder(npts);
+    for (size_t i=0; i<npts; ++i) ptorder[i] = voxelpts[i].second;
+    vector<pair<long,int> >().swap(voxelpts);
+    // the retained points of a voxel are moved first in its range
+    vector<int> nretained(nvoxels, 0);
+    vector<vector<int> > phases(27);
+    for (int v=0; v<nvoxels; ++v) {
+        long key = voxelkeys[v];
+        int vz = key % nvz, vy = (key / nvz) % nvy, vx = key / (nvz * nvy);
+        phases[(vx%3) * 9 + (vy%3) * 3 + vz%3].push_back(v);
+    }
+    uint32_t seed = rng();
+    FloatType mind2 = minimum_distance * minimum_distance;
     cout << "Percent complete: 0" << flush;
     int nextpercentcomplete = 5;
-    vector<size_t> retained_lines;
-    size_t initial_data_size = cloud.data.size();
-    while (!cloud.data.empty()) {
-        int percentcomplete = (initial_data_size - cloud.data.size()) * 100 / initial_data_size;
-        if (percentcomplete>=nextpercentcomplete) {
-            if (percentcomplete>=nextpercentcomplete) {
-                nextpercentcomplete+=5;
-                if (percentcomplete % 10 == 0) cout << percentcomplete << flush;
-                else if (percentcomplete % 5 == 0) cout << "." << flush;
+    for (int phase=0; phase<27; ++phase) {
+#pragma omp parallel for schedule(dynamic,16)
+        for (int pi=0; pi<(int)phases[phase].size(); ++pi) {
+            int v = phases[phase][pi];
+            long key = voxelkeys[v];
+            long vz = key % nvz, vy = (key / nvz) % nvy, vx = key / (nvz * nvy);
+            // adjacent voxels holding points
+            int adjacent[27];
+            int nadjacent = 0;
+            for (long dx=-1; dx<=1; ++dx) for (long dy=-1; dy<=1; ++dy) for (long dz=-1; dz<=1; ++dz) {
+                if (dx==0 && dy==0 && dz==0) continue;
+                if (vx+dx<0 || vx+dx>=nvx || vy+dy<0 || vy+dy>=nvy || vz+dz<0 || vz+dz>=nvz) continue;
+                long akey = ((vx+dx) * nvy + vy+dy) * nvz + vz+dz;
+                vector<long>::iterator it = lower_bound(voxelkeys.begin(), voxelkeys.end(), akey);
+                if (it!=voxelkeys.end() && *it==akey) adjacent[nadjacent++] = it - voxelkeys.begin();
+            }
+            // random order of the points in this voxel
+            boost::mt19937 voxelrng(seed ^ (uint32_t)(key * 2654435761UL) ^ (uint32_t)(key >> 32));
+            int* pts = &ptorder[voxelbegin[v]];
+            int n = voxelbegin[v+1] - voxelbegin[v];
+            for (int i=n-1; i>0; --i) swap(pts[i], pts[voxelrng() % (i+1)]);
+            int nret = 0;
+            for (int i=0; i<n; ++i) {
+                const PointIdx& p = cloud.data[pts[i]];
+                bool keep = true;
+                for (int j=0; keep && j<nret; ++j) keep = dist2(p, cloud.data[pts[j]]) > mind2;
+                for (int a=0; keep && a<nadjacent; ++a) {
+                    const int* apts = &ptorder[voxelbegin[adjacent[a]]];
+                    for (int j=0; keep && j<nretained[adjacent[a]]; ++j) keep = dist2(p, cloud.data[apts[j]]) > mind2;
+                }
+                if (keep) swap(pts[nret++], pts[i]);
             }
+            nretained[v] = nret;
+        }
+        int percentcomplete = (phase+1) * 100 / 27;
+        while (percentcomplete>=nextpercentcomplete) {
+            if (nextpercentcomplete % 10 == 0) cout << nextpercentcomplete << flush;
+            else cout << "." << flush;
+            nextpercentcomplete+=5;
         }
-
-        boost::uniform_int<int> int_dist(0, cloud.data.size()-1);
-        boost::variate_generator<boost::mt19937&, boost::uniform_int<int> > randint(rng, int_dist);
-        size_t selected_point = randint();
-        // WARNING: selected_point is the index of the data in the cloud.data vector
-        // the line number is given by the idx field of the data
-        retained_lines.push_back(cloud.data[selected_point].idx);
-        // now remove the neighbors. The indices of the data points in the data vector
-        // may change. This does not matter for the indices in the lines as these
-        // are saved within the points themselves. However removal shall be done
-        // from highest index to lowest index as elements are swapped with the last
-        // entry in the data vector during a removel (lower indices are unchanged)
-        vector<DistPoint<PointIdx> > neighbors;
-        cloud.findNeighbors(back_inserter(neighbors), cloud.data[selected_point], minimum_distance);
-        vector<int> data_indices(neighbors.size());
-        for (int i=0; i<neighbors.size(); ++i) data_indices[i] = neighbors[i].pt - &cloud.data[0];
-        sort(data_indices.begin(), data_indices.end(), greater<int>());
-        for (int i=0; i<neighbors.size(); ++i) cloud.remove(data_indices[i]);
     }
-    if (nextpercentcomplete==100) cout << 100;
     cout << endl;
+    vector<size_t> retained_lines;
+    for (int v=0; v<nvoxels; ++v) for (int j=0; j<nretained[v]; ++j) retained_lines.push_back(line_offsets[cloud.data[ptorder[voxelbegin[v]+j]].idx]);
 
     cout << "Sorting indices to retain" << endl;
     sort(retained_lines.begin(), retained_lines.end());
 
     cout << "Writing output file" << endl;
-    FILE* datafile = fopen(argv[1], "r");
-    if (!datafile) {std::cerr << "Could not load file: " << argv[1] << std::endl; return 1;}
-    char* line = 0; size_t linelen = 0; int num_read = 0;
-    size_t linenum = 0, retained_idx = 0;
-    while ((num_read = getline(&line, &linelen, datafile)) != -1) {
-        ++linenum;
-        if (linelen==0 || line[0]=='#') continue;
-        if (linenum==retained_lines[retained_idx]) {
-            resultfile << line;
-            ++retained_idx;
-        }
-    }
-    fclose(datafile);
+    // copy the retained lines from their offsets, by runs of consecutive lines
+    MappedTextFile input(argv[1]);
+    write_lines(resultfile, input, retained_lines);
+    size_t retained_idx = retained_lines.size();
 
     cout << "Retained " << retained_idx << " out of " << original_number_of_lines << " initial data points (subsampling ratio = 1/" << (double)original_number_of_lines/(double)retained_idx << ")" << endl;
 
@@ -24,15 +24,18 @@
 
 #include <iostream>
 #include <fstream>
+#include <string.h>
 
 #define FLOAT_TYPE double
 #include "points.hpp"
+#include "chunkio.hpp"
+#include "formatting.hpp"
 
 using namespace std;
 
 int help(const char* errmsg = 0) {
 cout << "\
-set_to_core cloud.xyz core.txt result.txt\n\
+set_to_core cloud.xyz core.txt result.txt [k [power]]\n\
   input: cloud.xyz      # Cloud point, containing x,y,z coordinates as the\n\
                         # first fields on each line. One point per line.\n\
   input: core.xyz       # Cloud of \"core\" points, containing x,y,z\n\
@@ -41,6 +44,14 @@ set_to_core cloud.xyz core.txt result.txt\n\
   output: result.txt     # Cloud point. Each of the original cloud.xyz line\n\
                         # is copied with the extra fields taken from that\n\
                         # line first, then from the nearest core point.\n\
+                        # If the file name ends with .bin, only the core point\n\
+                        # fields are written, in binary: the number of points and\n\
+                        # of fields as two ints, then the fields of each point as\n\
+                        # doubles (NaN for the fields a core point does not have).\n\
+  input: k              # Optional, 1 by default. If more than 1, the extra fields\n\
+                        # are interpolated from the k nearest core points, each\n\
+                        # weighted by its inverse distance to the power given below.\n\
+  input: power          # Optional, 2 by default. Power of the inverse distance weights.\n\
 "<<endl;
     if (errmsg) cout << "Error: " << errmsg << endl;
     return 0;
@@ -50,38 +61,155 @@ int main(int argc, char** argv) {
 
     if (argc<4) return help();
 
+    int knn = 1;
+    if (argc>4) knn = atoi(argv[4]);
+    if (knn<1) return help("Invalid number of nearest core points");
+    double power = 2;
+    if (argc>5) power = atof(argv[5]);
+
+    int outnamelen = strlen(argv[3]);
+    bool binary_output = outnamelen>=4 && !strcmp(argv[3]+outnamelen-4, ".bin");
+
     cout << "Loading core points" << endl;
     vector<vector<FloatType> > extrafields;
     PointCloud<Point> coreCloud;
     coreCloud.load_txt(argv[2], &extrafields);
-    
-    FILE* input_file = fopen(argv[1], "r");
-    ofstream output_file(argv[3]);
-    output_file.precision(20);
+    int ncorepoints = coreCloud.data.size();
+    if (ncorepoints==0) return help("No core point to join with");
+    if (knn>ncorepoints) knn = ncorepoints;
+    int nfields = 0;
+    for (int i=0; i<ncorepoints; ++i) nfields = max(nfields, (int)extrafields[i].size());
+
+    // the appended text of each core point is formatted once and for all
+    vector<char> coretext;
+    vector<size_t> coretextbegin(ncorepoints+1, 0);
+    if (knn==1 && !binary_output) {
+        char buf[format_max_chars+1];
+        for (int i=0; i<ncorepoints; ++i) {
+            for (int j=0; j<(int)extrafields[i].size(); ++j) {
+                buf[0] = ' ';
+                char* end = format_real(buf+1, extrafields[i][j]);
+                coretext.insert(coretext.end(), buf, end);
+            }
+            coretextbegin[i+1] = coretext.size();
+        }
+    }
+
+    TextChunkReader input_file(argv[1], true);
+    if (!input_file.ok()) {
+        cerr << "Could not load file: " << argv[1] << endl;
+        return 1;
+    }
+    ofstream output_file(argv[3], ofstream::binary);
+    int npts = 0;
+    if (binary_output) {
+        output_file.write((char*)&npts, sizeof(int));
+        output_file.write((char*)&nfields, sizeof(int));
+    }
     cout << "Processing file" << endl;
-    
-    int linenum = 0;
-    int nvalues = -1;
-    char* line = 0; size_t linelen = 0; int num_read = 0;
-    while ((num_read = getline(&line, &linelen, input_file)) != -1) {
-        ++linenum;
-        if (linelen==0) continue;
-        if (line[0]=='#') {output_file << line; continue;}
-        vector<double> values;
-        for (char* x = line; *x!=0;) values.push_back(fast_atof_next_token(x));
-        if (values.size()<3) {
-            cout << "Line " << linenum << " does not have valid xyz coordinates" << endl;
-            continue;
+
+    // parse -> nearest core points -> format pipeline, by chunks of lines
+    static const int streamchunk = 1 << 20;
+    static const int outchunk = 16384;
+    vector<char> text;
+    vector<size_t> offsets, linenums;
+    // per line: index of its point in the queries, -1 for a comment, -2 for an invalid line
+    vector<int> querynum;
+    vector<Point> queries;
+    vector<int> nearest;
+    vector<FloatType> nearestd2;
+    int nlines;
+    while ((nlines = input_file.read(streamchunk, text, offsets, &linenums)) > 0) {
+        querynum.resize(nlines);
+#pragma omp parallel for schedule(dynamic, 4096)
+        for (int li=0; li<nlines; ++li) {
+            char* line = &text[offsets[li]];
+            if (line[0]=='#') {querynum[li] = -1; continue;}
+            int nvalues = 0;
+            for (char* x = line; *x!=0; ++nvalues) fast_atof_next_token(x);
+            querynum[li] = nvalues<3 ? -2 : 0;
         }
-        int neighidx = coreCloud.findNearest(Point(values[0], values[1], values[2]));
-        if (neighidx==-1) {
-            cout << "Line " << linenum << ": no nearest core point, ligne ignored." << endl;
-            return 1;
+        int nqueries = 0;
+        for (int li=0; li<nlines; ++li) if (querynum[li]==0) querynum[li] = nqueries++;
+        queries.resize(nqueries);
+#pragma omp parallel for schedule(dynamic, 4096)
+        for (int li=0; li<nlines; ++li) if (querynum[li]>=0) parse_point_line(&text[offsets[li]], queries[querynum[li]]);
+        nearest.resize(nqueries * knn);
+        nearestd2.resize(nqueries * knn);
+        if (nqueries>0) coreCloud.findNearestNeighbors(&queries[0], nqueries, knn, &nearest[0], &nearestd2[0]);
+
+        int noutchunks = (nlines + outchunk - 1) / outchunk;
+#pragma omp parallel
+        {
+            vector<char> outbuf;
+            vector<double> fields(nfields), weights(nfields);
+            char buf[format_max_chars+1];
+            // the original line, without its end
+            auto copy_line = [&outbuf](const char* line) {
+                int len = strlen(line);
+                while (len>0 && (line[len-1]=='\n' || line[len-1]=='\r' || line[len-1]==' ' || line[len-1]=='\t')) --len;
+                outbuf.insert(outbuf.end(), line, line + len);
+            };
+#pragma omp for ordered schedule(dynamic,1)
+            for (int oc=0; oc<noutchunks; ++oc) {
+                outbuf.clear();
+                int begin = oc * outchunk;
+                int end = min(begin + outchunk, nlines);
+                for (int li=begin; li<end; ++li) {
+                    int qi = querynum[li];
+                    char* line = &text[offsets[li]];
+                    if (qi==-2) continue;
+                    if (qi==-1) {
+                        if (!binary_output) outbuf.insert(outbuf.end(), line, line + strlen(line));
+                        continue;
+                    }
+                    if (knn==1 && !binary_output) {
+                        copy_line(line);
+                        int ci = nearest[qi];
+                        outbuf.insert(outbuf.end(), coretext.begin() + coretextbegin[ci], coretext.begin() + coretextbegin[ci+1]);
+                        outbuf.push_back('\n');
+                        continue;
+                    }
+                    // inverse distance weighting of the fields over the k nearest core points
+                    int nfieldsthis = binary_output ? nfields : extrafields[nearest[qi*knn]].size();
+                    for (int j=0; j<nfieldsthis; ++j) fields[j] = weights[j] = 0;
+                    // a core point at the same location takes it all
+                    int ncontrib = nearestd2[qi*knn]<=0 ? 1 : knn;
+                    for (int i=0; i<ncontrib; ++i) {
+                        int ci = nearest[qi*knn+i];
+                        double w = ncontrib>1 ? pow(nearestd2[qi*knn+i], -0.5*power) : 1;
+                        int nf = min(nfieldsthis, (int)extrafields[ci].size());
+                        for (int j=0; j<nf; ++j) {
+                            fields[j] += w * extrafields[ci][j];
+                            weights[j] += w;
+                        }
+                    }
+                    for (int j=0; j<nfieldsthis; ++j) fields[j] = weights[j]>0 ? fields[j] / weights[j] : numeric_limits<double>::quiet_NaN();
+                    if (binary_output) {
+                        const char* f = (const char*)&fields[0];
+                        outbuf.insert(outbuf.end(), f, f + nfields * sizeof(double));
+                        continue;
+                    }
+                    copy_line(line);
+                    for (int j=0; j<nfieldsthis; ++j) {
+                        buf[0] = ' ';
+                        char* e = format_real(buf+1, fields[j]);
+                        outbuf.insert(outbuf.end(), buf, e);
+                    }
+                    outbuf.push_back('\n');
+                }
+#pragma omp ordered
+                {
+                    for (int li=begin; li<end; ++li) if (querynum[li]==-2) cout << "Line " << linenums[li] << " does not have valid xyz coordinates" << endl;
+                    if (!outbuf.empty()) output_file.write(&outbuf[0], outbuf.size());
+                }
+            }
         }
-        output_file << values[0] << " " << values[1] << " " << values[2];
-        for (int i=3; i<values.size(); ++i) output_file << " " << values[i];
-        for (auto x : extrafields[neighidx]) output_file << " " << x;
-        output_file << endl;
+        npts += nqueries;
+    }
+    if (binary_output) {
+        output_file.seekp(0);
+        output_file.write((char*)&npts, sizeof(int));
     }
     return 0;
 }
@@ -37,6 +37,8 @@
 #include <math.h>
 
 #include "points.hpp"
+#include "helpers.hpp"
+#include "densityraster.hpp"
 #include "base64.hpp"
 #include "linearSVM.hpp"
 
@@ -61,85 +63,6 @@ suggest_classifier [=N] outfile.svg [ unlabeled.msc ...] : class1.msc ... - clas
     return 0;
 }
 
-bool fpeq(FloatType a, FloatType b) {
-    static const FloatType epsilon = 1e-6;
-    if (b==0) return fabs(a)<epsilon;
-    FloatType ratio = a/b;
-    return ratio>1-epsilon && ratio<1+epsilon;
-}
-
-// if vector is empty, fill it
-// otherwise check the vectors match
-int read_msc_header(ifstream& mscfile, vector<FloatType>& scales, int& ptnparams) {
-    int npts;
-    mscfile.read((char*)&npts,sizeof(npts));
-    if (npts<=0) {
-        cerr << "invalid msc file (negative or null number of points)" << endl;
-        exit(1);
-    }
-    
-    int nscales_thisfile;
-    mscfile.read((char*)&nscales_thisfile, sizeof(nscales_thisfile));
-    if (nscales_thisfile<=0) {
-        cerr << "invalid msc file (negative or null number of scales)" << endl;
-        exit(1);
-    }
-#ifndef MAX_SCALES_IN_MSC_FILE
-#define MAX_SCALES_IN_MSC_FILE 1000000
-#endif
-    if (nscales_thisfile>MAX_SCALES_IN_MSC_FILE) {
-        cerr << "This msc file claims to contain more than " << MAX_SCALES_IN_MSC_FILE << " scales. Aborting, this is probably a mistake. If not, simply recompile with a different value for MAX_SCALES_IN_MSC_FILE." << endl;
-        exit(1);
-    }
-    vector<FloatType> scales_thisfile(nscales_thisfile);
-    for (int si=0; si<nscales_thisfile; ++si) mscfile.read((char*)&scales_thisfile[si], sizeof(FloatType));
-    
-    // all files must be consistant
-    if (scales.size() == 0) {
-        scales = scales_thisfile;
-    } else {
-        if (scales.size() != nscales_thisfile) {cerr<<"input file mismatch"<<endl; exit(1);}
-        for (int si=0; si<scales.size(); ++si) if (!fpeq(scales[si],scales_thisfile[si])) {cerr<<"input file mismatch"<<endl; exit(1);}
-    }
-    
-    // TODO: check consistency of ptnparams
-    mscfile.read((char*)&ptnparams, sizeof(int));
-
-    return npts;
-}
-
-void read_msc_data(ifstream& mscfile, int nscales, int npts, sample_type* data, int ptnparams) {
-    for (int pt=0; pt<npts; ++pt) {
-        // we do not care for the point coordinates and other parameters
-        for (int i=0; i<ptnparams; ++i) {
-            FloatType param;
-            mscfile.read((char*)&param, sizeof(FloatType));
-        }
-        for (int s=0; s<nscales; ++s) {
-            FloatType a,b;
-            mscfile.read((char*)(&a), sizeof(FloatType));
-            mscfile.read((char*)(&b), sizeof(FloatType));
-            FloatType c = 1 - a - b;
-            // project in the equilateral triangle a*(0,0) + b*(1,0) + c*(1/2,sqrt3/2)
-            // equivalently to the triangle formed by the three components unit vector
-            // (1,0,0), (0,1,0) and (0,0,1) when considering a,b,c in 3D
-            // so each a,b,c = dimensionality of the data is given equal weight
-            // is this necessary ? => not for linear classifiers, but plan ahead...
-            FloatType x = b + c / 2;
-            FloatType y = c * sqrt(3)/2;
-            (*data)(s*2) = x;
-            (*data)(s*2+1) = y;
-        }
-        // we do not care for number of neighbors and average dist between nearest neighbors
-        // TODO: take this info into account to weight the samples and improve the classifier
-        int fooi;
-        for (int i=0; i<nscales; ++i) mscfile.read((char*)&fooi, sizeof(int));
-/*        FloatType foof;
-        for (int i=0; i<nscales; ++i) mscfile.read((char*)&foof, sizeof(FloatType));*/
-        ++data;
-    }
-}
-
 void GramSchmidt(dlib::matrix<dlib::matrix<double,0,1>,0,1>& basis, dlib::matrix<double,0,1>& newX) {
     using namespace dlib;
     // goal: find a basis so that the given vector is the new X
@@ -222,10 +145,9 @@ int main(int argc, char** argv) {
     int ndata_unlabeled = 0;
     vector<FloatType> scales;
     for (int argi = arg_shift+2; argi<arg_class1-1; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         // read the file header
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        mscfile.close();
         ndata_unlabeled += npts;
     }
     int nscales = scales.size();
@@ -235,12 +157,11 @@ int main(int argc, char** argv) {
     vector<sample_type> data_unlabeled(ndata_unlabeled, undefsample);
     int base_pt = 0;
     for (int argi = arg_shift+2; argi<arg_class1-1; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         // read the file header (again)
         int npts = read_msc_header(mscfile, scales, ptnparams);
         // read data
-        read_msc_data(mscfile,nscales,npts,&data_unlabeled[base_pt], ptnparams);
-        mscfile.close();
+        read_msc_samples(mscfile,npts,&data_unlabeled[base_pt]);
         base_pt += npts;
     }
     
@@ -249,17 +170,15 @@ int main(int argc, char** argv) {
     // class1 files
     int ndata_class1 = 0;
     for (int argi = arg_class1; argi<arg_class2-1; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        mscfile.close();
         ndata_class1 += npts;
     }
     // class2 files
     int ndata_class2 = 0;
     for (int argi = arg_class2; argi<argc; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        mscfile.close();
         ndata_class2 += npts;
     }
     nscales = scales.size(); // in case there is no unlabeled data
@@ -273,17 +192,15 @@ int main(int argc, char** argv) {
     
     base_pt = 0;
     for (int argi = arg_class1; argi<arg_class2-1; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        read_msc_data(mscfile,nscales,npts,&samples[base_pt], ptnparams);
-        mscfile.close();
+        read_msc_samples(mscfile,npts,&samples[base_pt]);
         base_pt += npts;
     }
     for (int argi = arg_class2; argi<argc; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        read_msc_data(mscfile,nscales,npts,&samples[base_pt], ptnparams);
-        mscfile.close();
+        read_msc_samples(mscfile,npts,&samples[base_pt]);
         base_pt += npts;
     }
     
@@ -482,40 +399,45 @@ int main(int argc, char** argv) {
         else absmaxXY = halfSvgSize / scaleFactor;
     }
 
-    PointCloud<Point2D> cloud2D;
-    cloud2D.prepare(xming,xmaxg,yming,ymaxg,nsamples+data_unlabeled.size());
-    for (int i=0; i<data_unlabeled.size(); ++i) cloud2D.insert(Point2D(
+    FloatType absxymax = fabs(max(max(max(-xming,xmaxg),-yming),ymaxg));
+    int nsearchpointm1 = 100;
+    // radius from probabilistic SVM, diameter = 90% chance of correct classif
+    FloatType radius = -log(1.0/0.9 - 1.0) / 2;
+
+    // the points are binned once, each density evaluation is then a few table lookups
+    DensityRaster raster;
+    raster.prepare(xming,xmaxg,yming,ymaxg,radius);
+    for (int i=0; i<data_unlabeled.size(); ++i) raster.insert(
         classifier.predict(data_unlabeled[i]),
         ortho_classifier.predict(data_unlabeled[i])
-    ));
+    );
     for (int i=0; i<nsamples; ++i) {
-        cloud2D.insert(Point2D(proj1[i],proj2[i]));
+        raster.insert(proj1[i],proj2[i]);
     }
-    
-    FloatType absxymax = fabs(max(max(max(-xming,xmaxg),-yming),ymaxg));
-    int nsearchpointm1 = 25;
-    // radius from probabilistic SVM, diameter = 90% chance of correct classif
-    FloatType radius = -log(1.0/0.9 - 1.0) / 2;
+    raster.finalize();
     
     FloatType wx = 0, wy = 0, wc = 0, minspcx = 0, minspcy = 0;
 
     if (ndata_unlabeled) {
-        int minsumd = numeric_limits<int>::max();
+        double minsumd = numeric_limits<double>::max();
         FloatType minvx = 0, minvy = 0;
 
         cout << "Finding the line with least density" << flush;
         
+        // the lines span the whole domain, sampled every half radius at most
+        FloatType linelength = max(xmaxg-xming, ymaxg-yming);
+        int nlinesamples = min(max((int)ceil(linelength / (radius / 2)), 1), 200) + 1;
+        FloatType incr = linelength / (nlinesamples - 1);
         for (int spci = 0; spci <= nsearchpointm1; ++spci) {
-            cout << "." << flush;
+            if (spci % 4 == 0) cout << "." << flush;
             
             FloatType spcx = refpt_neg.x + spci * (refpt_pos.x - refpt_neg.x) / nsearchpointm1;
             FloatType spcy = refpt_neg.y + spci * (refpt_pos.y - refpt_neg.y) / nsearchpointm1;
         
             // now we swipe a decision boundary in each direction around the point
             // and look for the lowest overall density along the boundary
-            int nsearchdir = 90; // each 2 degree, as we swipe from 0 to 180 (unoriented lines)
-            FloatType incr = max(xmaxg-xming, ymaxg-yming) / nsearchpointm1;
-            vector<FloatType> sumds(nsearchdir);
+            int nsearchdir = 360; // each half degree, as we swipe from 0 to 180 (unoriented lines)
+            vector<double> sumds(nsearchdir);
     #pragma omp parallel for
             for(int sd = 0; sd < nsearchdir; ++sd) {
                 // use the parametric P = P0 + alpha*V formulation of a line
@@ -523,13 +445,11 @@ int main(int argc, char** argv) {
                 FloatType vx = cos(M_PI * sd / nsearchdir);
                 FloatType vy = sin(M_PI * sd / nsearchdir);
                 sumds[sd] = 0;
-                for(int sp = -nsearchpointm1/2; sp < nsearchpointm1/2; ++sp) {
-                    int s = sp * incr;
+                for(int sp = 0; sp < nlinesamples; ++sp) {
+                    FloatType s = (sp - (nlinesamples - 1) * FloatType(0.5)) * incr;
                     FloatType x = vx * s + spcx;
                     FloatType y = vy * s + spcy;
-                    vector<DistPoint<Point2D> > neighbors;
-                    cloud2D.findNeighbors(back_inserter(neighbors), Point2D(x,y), radius);
-                    sumds[sd] += neighbors.size();
+                    sumds[sd] += raster.disk_count(x, y, radius);
                 }
             }
             for(int sd = 0; sd < nsearchdir; ++sd) {
@@ -22,12 +22,13 @@
 //*                                                                    *
 //**********************************************************************/
 /*
-This is just a wrapper around LAPACK's dgesvd and sgesvd function
+This is just a wrapper around LAPACK's dgesvd and sgesvd functions (and dsyev)
 */
 #ifndef CANUPO_SVD_H
 #define CANUPO_SVD_H
 
 #include <iostream>
+#include <vector>
 #include <stdlib.h>
 
 /* So, do not use the ublas wrapper.
@@ -37,6 +38,14 @@ This is just a wrapper around LAPACK's dgesvd and sgesvd function
 extern "C" {
     void dgesvd_(char const* jobu, char const* jobvt, const int* M, const int* N, double* A, const int* lda, double* S, double* U, const int* ldu, double* Vt, const int* ldvt, double* work, const int* lwork, int *info);
     void sgesvd_(char const* jobu, char const* jobvt, const int* M, const int* N, float* A, const int* lda, float* S, float* U, const int* ldu, float* Vt, const int* ldvt, float* work, const int* lwork, int *info);
+    void dsyev_(char const* jobz, char const* uplo, const int* N, double* A, const int* lda, double* W, double* work, const int* lwork, int *info);
+}
+
+// LAPACK work arrays, kept per thread and only grown when a larger matrix is met
+// so the per-core-point calls do no heap allocation once warmed up
+template<typename T> inline std::vector<T>& svd_workspace() {
+    static thread_local std::vector<T> work;
+    return work;
 }
 
 // wrapper to simplify somewhat the calls.
@@ -72,21 +81,20 @@ void svd(int nrows, int ncols, double* A, double* S, bool projectObservations =
     int info = 0;
     double Dummy; int ld_Dummy = 1;
     int lwork = -1;
-    double *tmpwork = new double[ncols]; // in case of failure, elements 1:ncols-1 are referenced
-    dgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, tmpwork, &lwork, &info);
+    std::vector<double>& work = svd_workspace<double>();
+    if ((int)work.size()<ncols) work.resize(ncols); // in case of failure, elements 1:ncols-1 are referenced
+    dgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, &work[0], &lwork, &info);
     if (info) {
         std::cerr << "Could not retreive the work array size for lapack" << std::endl;
         exit(1);
     }
-    lwork = (int)tmpwork[0];
-    double* work = new double[lwork];
-    dgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, work, &lwork, &info);
+    lwork = (int)work[0];
+    if ((int)work.size()<lwork) work.resize(lwork);
+    dgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, &work[0], &lwork, &info);
     if (info) {
         std::cerr << "Error in dgesvd: " << info << std::endl;
         exit(1);
     }
-    delete [] tmpwork;
-    delete [] work;
 #ifndef LAPACK_IS_THREAD_SAFE
 }
 #endif
@@ -101,25 +109,55 @@ void svd(int nrows, int ncols, float* A, float* S, bool projectObservations = fa
     int info = 0;
     float Dummy; int ld_Dummy = 1;
     int lwork = -1;
-    float *tmpwork = new float[ncols]; // in case of failure, elements 1:ncols-1 are referenced
-    sgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, tmpwork, &lwork, &info);
+    std::vector<float>& work = svd_workspace<float>();
+    if ((int)work.size()<ncols) work.resize(ncols); // in case of failure, elements 1:ncols-1 are referenced
+    sgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, &work[0], &lwork, &info);
     if (info) {
         std::cerr << "Could not retreive the work array size for lapack" << std::endl;
         exit(1);
     }
-    lwork = (int)tmpwork[0];
-    float* work = new float[lwork];
-    sgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, work, &lwork, &info);
+    lwork = (int)work[0];
+    if ((int)work.size()<lwork) work.resize(lwork);
+    sgesvd_(projectObservations?"O":"N", B==0?"N":"S", &nrows, &ncols, A, &nrows, S, &Dummy, &ld_Dummy, B==0 ? &Dummy : B, &ncols, &work[0], &lwork, &info);
     if (info) {
         std::cerr << "Error in sgesvd: " << info << std::endl;
         exit(1);
     }
-    delete [] tmpwork;
-    delete [] work;
 #ifndef LAPACK_IS_THREAD_SAFE
 }
 #endif
 }
 
+// Eigen decomposition of the symmetric N x N matrix A, for when the scatter matrix
+// is already available (ex: accumulated moments) and there is no point in an SVD.
+// A is column-major, only its upper triangle is read.
+// W shall be an array of size N. It will be filled with the eigenvalues, in increasing order
+// If computeVectors is true, A is overwritten with the corresponding eigenvectors as columns,
+// otherwise it is filled with garbage.
+void symeig(int n, double* A, double* W, bool computeVectors = false) {
+#ifndef LAPACK_IS_THREAD_SAFE
+#pragma omp critical
+{
+#endif
+    int info = 0;
+    int lwork = -1;
+    std::vector<double>& work = svd_workspace<double>();
+    if (work.empty()) work.resize(1);
+    dsyev_(computeVectors?"V":"N", "U", &n, A, &n, W, &work[0], &lwork, &info);
+    if (info) {
+        std::cerr << "Could not retreive the work array size for lapack" << std::endl;
+        exit(1);
+    }
+    lwork = (int)work[0];
+    if ((int)work.size()<lwork) work.resize(lwork);
+    dsyev_(computeVectors?"V":"N", "U", &n, A, &n, W, &work[0], &lwork, &info);
+    if (info) {
+        std::cerr << "Error in dsyev: " << info << std::endl;
+        exit(1);
+    }
+#ifndef LAPACK_IS_THREAD_SAFE
+}
+#endif
+}
 
 #endif
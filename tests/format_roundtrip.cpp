@@ -0,0 +1,87 @@
+//**********************************************************************
+//* This file is a part of the CANUPO project, a set of programs for   *
+//* classifying automatically 3D point clouds according to the local   *
+//* multi-scale dimensionality at each point.                          *
+//*                                                                    *
+//* Author & Copyright: Nicolas Brodu <nicolas.brodu@numerimoire.net>  *
+//*                                                                    *
+//* This project is free software; you can redistribute it and/or      *
+//* modify it under the terms of the GNU Lesser General Public         *
+//* License as published by the Free Software Foundation; either       *
+//* version 2.1 of the License, or (at your option) any later version. *
+//*                                                                    *
+//* This library is distributed in the hope that it will be useful,    *
+//* but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+//* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU  *
+//* Lesser General Public License for more details.                    *
+//*                                                                    *
+//* You should have received a copy of the GNU Lesser General Public   *
+//* License along with this library; if not, write to the Free         *
+//* Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,    *
+//* MA  02110-1301  USA                                                *
+//*                                                                    *
+//**********************************************************************/
+
+// Checks that the formatted numbers read back exactly, and never overflow
+// format_max_chars. Returns non-zero on failure.
+
+#include <iostream>
+#include <string.h>
+#include <stdint.h>
+
+#include "../formatting.hpp"
+
+using namespace std;
+
+static int nfailures = 0;
+
+// each number is written in a poisoned buffer, then checked for length and value
+template<typename T, typename F>
+void check(T v, F format, const char* what) {
+    char buf[format_max_chars + 8];
+    memset(buf, 'x', sizeof(buf));
+    char* end = format(buf, v);
+    int n = end - buf;
+    bool ok = n > 0 && n < format_max_chars && memchr(buf, 0, n)==0;
+    if (ok) {
+        buf[n] = 0;
+        T back = sizeof(T)==sizeof(float) ? strtof(buf, 0) : strtod(buf, 0);
+        ok = back==v || (v!=v && back!=back);
+    }
+    if (!ok) {
+        if (++nfailures <= 10) cerr << what << ": " << v << " written as \"" << string(buf, max(0, min(n, format_max_chars))) << "\"" << endl;
+    }
+}
+
+inline char* real_double(char* p, double v) {return format_real(p, v);}
+inline char* real_float(char* p, float v) {return format_real(p, v);}
+inline char* shortest_double(char* p, double v) {return format_real_shortest(p, v);}
+inline char* shortest_float(char* p, float v) {return format_real_shortest(p, v);}
+
+int main() {
+    // the longest doubles: negative, 17 digits and 3-digit exponents
+    const double extremes[] = {-1.2345678901234567e-150, -1.2345678901234567e+150, -2.2250738585072014e-308, -1.7976931348623157e+308, -4.9406564584124654e-324, 1.2345678901234567e-100};
+    for (int i=0; i<(int)(sizeof(extremes)/sizeof(double)); ++i) {
+        check(extremes[i], real_double, "format_real(double)");
+        check(extremes[i], shortest_double, "format_real_shortest(double)");
+    }
+    const float float_extremes[] = {-1.17549435e-38f, -3.40282347e+38f, -1.40129846e-45f, -1.23456789e-20f};
+    for (int i=0; i<(int)(sizeof(float_extremes)/sizeof(float)); ++i) check(float_extremes[i], shortest_float, "format_real_shortest(float)");
+    // random bit patterns, xorshift for reproducibility
+    uint64_t state = 88172645463325252ULL;
+    for (int i=0; i<2000000; ++i) {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        double d; memcpy(&d, &state, sizeof(d));
+        float f; uint32_t bits = (uint32_t)(state >> 32); memcpy(&f, &bits, sizeof(f));
+        check(d, real_double, "format_real(double)");
+        check(f, real_float, "format_real(float)");
+        check(d, shortest_double, "format_real_shortest(double)");
+        check(f, shortest_float, "format_real_shortest(float)");
+    }
+    if (nfailures) {
+        cerr << nfailures << " numbers did not read back" << endl;
+        return 1;
+    }
+    cout << "format round trip: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# set_to_core must write extreme double fields without truncation: negative values
+# with 3-digit exponents are the longest numbers. Usage: set_to_core_check.sh [bindir]
+BIN=${1:-.}
+TMP=${TMPDIR:-/tmp}/set_to_core_check.$$
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+printf '0 0 0\n1 0 0\n0 1 0\n1 1 0\n' > $TMP/cloud.xyz
+printf '0 0 0 -1.2345678901234567e-150 -9.8765432109876543e+250\n1 1 0 -3.4567890123456789e-200 -5.6789012345678901e+200\n' > $TMP/core.xyz
+status=0
+for k in 1 2; do
+    if ! $BIN/set_to_core $TMP/cloud.xyz $TMP/core.xyz $TMP/out$k.txt $k > /dev/null; then
+        echo "set_to_core failed with k=$k"; exit 1
+    fi
+    if [ "$(tr -d '\000' < $TMP/out$k.txt | wc -c)" != "$(wc -c < $TMP/out$k.txt)" ]; then
+        echo "k=$k: NUL bytes in the output"; status=1
+    fi
+    # every line gets both fields, within the range of the core values
+    awk -v k=$k 'NF!=5 || $4>=0 || $4<-1.3e-150 || $4>-3.4e-200 || $5>=0 || $5<-9.9e250 || $5>-5.6e200 {print "k=" k ": bad line " NR ": " $0; bad=1} END {exit bad}' $TMP/out$k.txt || status=1
+done
+# with k=1 the first point takes the fields of the first core point
+awk 'NR==1 {r1 = $4 / -1.2345678901234567e-150; r2 = $5 / -9.8765432109876543e+250; if (r1<1-1e-12 || r1>1+1e-12 || r2<1-1e-12 || r2>1+1e-12) {print "k=1: wrong values: " $0; exit 1}}' $TMP/out1.txt || status=1
+[ $status = 0 ] && echo "set_to_core extreme fields: ok"
+exit $status
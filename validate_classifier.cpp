@@ -35,6 +35,7 @@
 #include <stdint.h>
 
 #include "classifier.hpp"
+#include "helpers.hpp"
 
 #include "base64.hpp"
 
@@ -58,66 +59,12 @@ validate_classifier  user_modified.svg  classifier_file.prm  [ class_num_1  clas
         return 0;
 }
 
-bool fpeq(FloatType a, FloatType b) {
-    static const FloatType epsilon = 1e-6;
-    if (b==0) return fabs(a)<epsilon;
-    FloatType ratio = a/b;
-    return ratio>1-epsilon && ratio<1+epsilon;
-}
-
 struct LineDef {
     FloatType wx, wy, c;
 };
 
 typedef vector<FloatType> sample_type;
 
-// if vector is empty, fill it
-// otherwise check the vectors match
-int read_msc_header(ifstream& mscfile, vector<FloatType>& scales, int& ptnparams) {
-    int npts;
-    mscfile.read((char*)&npts,sizeof(npts));
-    if (npts<=0) help("invalid file");
-    
-    int nscales_thisfile;
-    mscfile.read((char*)&nscales_thisfile, sizeof(nscales_thisfile));
-    vector<FloatType> scales_thisfile(nscales_thisfile);
-    for (int si=0; si<nscales_thisfile; ++si) mscfile.read((char*)&scales_thisfile[si], sizeof(FloatType));
-    if (nscales_thisfile<=0) help("invalid file");
-    
-    // all files must be consistant
-    if (scales.size() == 0) {
-        scales = scales_thisfile;
-    } else {
-        if (scales.size() != nscales_thisfile) {cerr<<"input file mismatch: "<<endl; return 1;}
-        for (int si=0; si<scales.size(); ++si) if (!fpeq(scales[si],scales_thisfile[si])) {cerr<<"input file mismatch: "<<endl; return 1;}
-    }
-    mscfile.read((char*)&ptnparams, sizeof(int));
-
-    return npts;
-}
-
-void read_msc_data(ifstream& mscfile, int nscales, int npts, sample_type* data, int ptnparams) {
-    for (int pt=0; pt<npts; ++pt) {
-        for (int i=0; i<ptnparams; ++i) {
-            FloatType param;
-            mscfile.read((char*)&param, sizeof(FloatType));
-        }
-        for (int s=0; s<nscales; ++s) {
-            FloatType a,b;
-            mscfile.read((char*)(&a), sizeof(FloatType));
-            mscfile.read((char*)(&b), sizeof(FloatType));
-            FloatType c = 1 - a - b;
-            FloatType x = b + c / 2;
-            FloatType y = c * sqrt(3)/2;
-            (*data)[s*2] = x;
-            (*data)[s*2+1] = y;
-        }
-        int fooi;
-        for (int i=0; i<nscales; ++i) mscfile.read((char*)&fooi, sizeof(int));
-        ++data;
-    }
-}
-
 int main(int argc, char** argv) {
 
     if (argc<7 && argc!=3 && argc!=5) return help();
@@ -344,17 +291,15 @@ int main(int argc, char** argv) {
     // class1 files
     int ndata_class1 = 0;
     for (int argi = arg_class1; argi<arg_class2-1; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        mscfile.close();
         ndata_class1 += npts;
     }
     // class2 files
     int ndata_class2 = 0;
     for (int argi = arg_class2; argi<argc; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        mscfile.close();
         ndata_class2 += npts;
     }
     undefsample.resize(fdim,FloatType(0));
@@ -363,17 +308,15 @@ int main(int argc, char** argv) {
 
     int base_pt = 0;
     for (int argi = arg_class1; argi<arg_class2-1; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        read_msc_data(mscfile,nscales,npts,&samples[base_pt], ptnparams);
-        mscfile.close();
+        read_msc_samples(mscfile,npts,&samples[base_pt]);
         base_pt += npts;
     }
     for (int argi = arg_class2; argi<argc; ++argi) {
-        ifstream mscfile(argv[argi], ifstream::binary);
+        MSCFile mscfile(argv[argi]);
         int npts = read_msc_header(mscfile, scales, ptnparams);
-        read_msc_data(mscfile,nscales,npts,&samples[base_pt], ptnparams);
-        mscfile.close();
+        read_msc_samples(mscfile,npts,&samples[base_pt]);
         base_pt += npts;
     }
 
@@ -386,17 +329,31 @@ int main(int argc, char** argv) {
     classifier.absmaxXY = absmaxXY;
     classifier.prepare();
 
+    // project and classify all samples in blocks
+    ProjectionBank projbank;
+    projbank.prepare(&classifier, 1);
+    static const int projblock = 256;
+    vector<FloatType> preds(nsamples);
+    vector<FloatType> blockdata(projblock * fdim);
+    vector<FloatType> projab(projblock * 2);
+    for (int bi=0; bi<nsamples; bi+=projblock) {
+        int nblock = min(projblock, nsamples - bi);
+        for (int i=0; i<nblock; ++i) copy(samples[bi+i].begin(), samples[bi+i].end(), &blockdata[i*fdim]);
+        projbank.project(&blockdata[0], fdim, 0, nblock, &projab[0]);
+        classifier.classify2D(&projab[0], nblock, 2, &preds[bi], 1);
+    }
+
     // true/false positive/negative counts
     FloatType TP=0, TN=0, FP=0, FN=0;
     double m1 = 0, m2 = 0, v1 = 0, v2=0;
     for (int i=0; i<ndata_class1; ++i) {
-        FloatType pred = classifier.classify(&samples[i][0]);
+        FloatType pred = preds[i];
         if (pred<0) ++TP;
         else ++FN;
         m1+=pred; v1+=pred*pred;
     }
     for (int i=ndata_class1; i<nsamples; ++i) {
-        FloatType pred = classifier.classify(&samples[i][0]);
+        FloatType pred = preds[i];
         if (pred>0) ++TN;
         else ++FP;
         m2+=pred; v2+=pred*pred;
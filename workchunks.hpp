@@ -0,0 +1,123 @@
+//**********************************************************************
+//* This file is a part of the CANUPO project, a set of programs for   *
+//* classifying automatically 3D point clouds according to the local   *
+//* multi-scale dimensionality at each point.                          *
+//*                                                                    *
+//* Author & Copyright: Nicolas Brodu <nicolas.brodu@numerimoire.net>  *
+//*                                                                    *
+//* This project is free software; you can redistribute it and/or      *
+//* modify it under the terms of the GNU Lesser General Public         *
+//* License as published by the Free Software Foundation; either       *
+//* version 2.1 of the License, or (at your option) any later version. *
+//*                                                                    *
+//* This library is distributed in the hope that it will be useful,    *
+//* but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+//* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU  *
+//* Lesser General Public License for more details.                    *
+//*                                                                    *
+//* You should have received a copy of the GNU Lesser General Public   *
+//* License along with this library; if not, write to the Free         *
+//* Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,    *
+//* MA  02110-1301  USA                                                *
+//*                                                                    *
+//**********************************************************************/
+#ifndef CANUPO_WORKCHUNKS_HPP
+#define CANUPO_WORKCHUNKS_HPP
+
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include "points.hpp"
+
+/*
+Load balancing for the per-core-point loops.
+
+The cost of a core point is roughly proportional to the number of data points that
+are scanned when looking for its neighbors at the max scale. This is estimated in O(1)
+per core point from the occupancy of the grid cells covered by the search window,
+using a summed-area table over the cell counts.
+
+Core points are then ordered along a Morton curve on the grid cells, so consecutive
+points share their neighborhoods, and cut into chunks of roughly equal cost. The
+chunks are sorted by decreasing cost so that handing them out dynamically (ex: omp
+schedule(dynamic,1)) leaves only small chunks for the end of the loop.
+*/
+
+struct WorkChunk {
+    int begin, end; // range in the ordered core point list
+    double cost;
+    bool operator<(const WorkChunk& other) const {
+        // largest first
+        return cost > other.cost;
+    }
+};
+
+inline uint64_t morton_interleave(uint32_t x) {
+    uint64_t v = x;
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+}
+
+// order: on output, the core point indices in processing order
+// chunks: on output, ranges of order of about equal cost, largest first
+template<class PointType, class CorePointType>
+void make_work_chunks(const PointCloud<PointType>& cloud, const std::vector<CorePointType>& corepoints, FloatType radius, int nchunks, std::vector<int>& order, std::vector<WorkChunk>& chunks) {
+    using namespace std;
+    int ncellx = cloud.ncellx, ncelly = cloud.ncelly;
+    // summed-area table of the cell occupancies, with a 0 row and column
+    vector<double> sat((ncellx+1) * (ncelly+1), 0.);
+    for (int cy = 0; cy < ncelly; ++cy) for (int cx = 0; cx < ncellx; ++cx) {
+        int count = 0;
+        for (IndexType p = cloud.grid[cy * ncellx + cx]; p!=IndexType(-1); p=cloud.links[p]) ++count;
+        sat[(cy+1)*(ncellx+1)+cx+1] = count + sat[cy*(ncellx+1)+cx+1] + sat[(cy+1)*(ncellx+1)+cx] - sat[cy*(ncellx+1)+cx];
+    }
+
+    int npts = corepoints.size();
+    vector<double> cost(npts);
+    vector<pair<uint64_t,int> > keys(npts);
+    for (int i=0; i<npts; ++i) {
+        const CorePointType& center = corepoints[i];
+        // same cell window as the neighbor search
+        int cx1 = max(0, min(ncellx, (int)floor((center.x - radius - cloud.xmin) / cloud.cellside)));
+        int cx2 = max(-1, min(ncellx-1, (int)floor((center.x + radius - cloud.xmin) / cloud.cellside)));
+        int cy1 = max(0, min(ncelly, (int)floor((center.y - radius - cloud.ymin) / cloud.cellside)));
+        int cy2 = max(-1, min(ncelly-1, (int)floor((center.y + radius - cloud.ymin) / cloud.cellside)));
+        double scanned = 0;
+        if (cx1<=cx2 && cy1<=cy2) scanned = sat[(cy2+1)*(ncellx+1)+cx2+1] - sat[cy1*(ncellx+1)+cx2+1] - sat[(cy2+1)*(ncellx+1)+cx1] + sat[cy1*(ncellx+1)+cx1];
+        // constant term for the per-point overhead, even with no neighbors
+        cost[i] = scanned + 1;
+        int cx = max(0, min(ncellx-1, (int)floor((center.x - cloud.xmin) / cloud.cellside)));
+        int cy = max(0, min(ncelly-1, (int)floor((center.y - cloud.ymin) / cloud.cellside)));
+        keys[i] = make_pair(morton_interleave(cx) | (morton_interleave(cy) << 1), i);
+    }
+    sort(keys.begin(), keys.end());
+
+    order.resize(npts);
+    double totalcost = 0;
+    for (int i=0; i<npts; ++i) {
+        order[i] = keys[i].second;
+        totalcost += cost[order[i]];
+    }
+
+    chunks.clear();
+    if (nchunks<1) nchunks = 1;
+    double target = totalcost / nchunks;
+    WorkChunk chunk; chunk.begin = 0; chunk.cost = 0;
+    for (int i=0; i<npts; ++i) {
+        chunk.cost += cost[order[i]];
+        if (chunk.cost >= target || i==npts-1) {
+            chunk.end = i+1;
+            chunks.push_back(chunk);
+            chunk.begin = i+1; chunk.cost = 0;
+        }
+    }
+    sort(chunks.begin(), chunks.end());
+}
+
+#endif